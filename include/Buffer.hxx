@@ -109,6 +109,7 @@ namespace SoDa {
      */
     Buffer(size_t len) {
       vec_p = std::make_shared<std::vector<T>>(len); 
+      length = len; 
     }
 
     /**
@@ -132,15 +133,37 @@ namespace SoDa {
      * @returns Reference to the vector. 
      */
     operator std::vector<T> & () { return getVec(); }
+
+    /**
+     * @brief How many elements were asked for? 
+     *
+     * A buffer from a SoDa::BufferPool that uses size classes may
+     * enclose a vector that is longer than the caller asked for.
+     * size() reports the length that was asked for. 
+     *
+     * @returns the logical length of the buffer. 
+     */
+    size_t size() const { return length; }
     
   protected:
     std::shared_ptr<std::vector<T>> vec_p;
+    size_t length; 
     
     /**
      * @brief Create a buffer from a vector supplied elsewhere. 
      */
     Buffer(std::shared_ptr<std::vector<T>> & vptr) {
       vec_p = vptr; 
+      length = vptr->size();
+    }
+
+    /**
+     * @brief Create a buffer from a vector supplied elsewhere, 
+     * using only the first len elements. 
+     */
+    Buffer(std::shared_ptr<std::vector<T>> & vptr, size_t len) {
+      vec_p = vptr; 
+      length = len; 
     }
   };
 
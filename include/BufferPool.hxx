@@ -7,10 +7,18 @@
 #include <vector>
 #include <map>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <cstddef>
 
 #include <iostream>
 
 #include "Buffer.hxx"
+#include "ThreadSlot.hxx"
+#include "BufferStorage.hxx"
+#include "Stats.hxx"
 
 /*
 BSD 2-Clause License
@@ -80,6 +88,170 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * software defined radios or any of that stuff.
  */
 namespace SoDa {
+  template <typename T> class BufferPool;
+
+  /**
+   * @brief Inside baseball: the header of a block allocated by
+   * SoDa::BufferPool::getHandle().
+   *
+   * The header and the buffer's elements live in a single
+   * allocation.  The header is padded to a multiple of 64 bytes (or
+   * of the storage's alignment, if that is bigger), so when the block
+   * itself starts on a cache line -- as it does with both
+   * SoDa::AlignedStorage and SoDa::MMapStorage -- the elements start
+   * on the next cache line after the header, and banging on the
+   * reference count doesn't drag the payload's first line around
+   * between cores.
+   */
+  template <typename T>
+  struct PoolBlock {
+    std::atomic<int> refcount;
+    BufferPool<T> * pool;
+    size_t size_key;   ///< the free list that this block goes back to.
+    size_t length;     ///< the number of elements the caller asked for.
+    size_t capacity;   ///< the number of elements in the payload.
+    int node;          ///< the NUMA node whose free list this block belongs to.
+    unsigned int payload_offset; ///< bytes from the start of the block to the elements.
+
+    /**
+     * @brief How big is the header, once it is padded out so that
+     * the payload is aligned?
+     *
+     * @param align the alignment of the block itself.
+     */
+    static size_t headerBytes(size_t align) {
+      if(align < 64) align = 64;
+      if(align < alignof(T)) align = alignof(T);
+      return ((sizeof(PoolBlock<T>) + align - 1) / align) * align;
+    }
+    
+    T * data() {
+      return reinterpret_cast<T*>(reinterpret_cast<char*>(this) + payload_offset);
+    }
+
+    size_t blockBytes() const {
+      return payload_offset + capacity * sizeof(T);
+    }
+  };
+
+  /**
+   * @class BufferHandle
+   *
+   * @brief A reference counted handle to a buffer allocated by
+   * SoDa::BufferPool::getHandle().
+   *
+   * This is the allocation-free alternative to the shared_ptr that
+   * getFromPool() hands out.  The reference count, the owning pool, and
+   * the elements are all in one pooled block, and the handle itself is
+   * just a pointer to that block. When the last handle goes away, the
+   * whole block goes back to the pool.  Once the pool is warmed up,
+   * a getHandle()/release cycle does no heap allocation at all.
+   *
+   * A BufferHandle behaves like a shared_ptr as far as SoDa::MailBox is
+   * concerned -- it can be copied, compared to nullptr, and T(0) is an
+   * empty handle.
+   *
+   * The price is that there is no std::vector in here. Code that
+   * needs a std::vector<T> & should use getFromPool().
+   */
+  template <typename T>
+  class BufferHandle {
+  public:
+    BufferHandle() noexcept : blk(nullptr) { }
+    BufferHandle(std::nullptr_t) noexcept : blk(nullptr) { }
+
+    BufferHandle(const BufferHandle & other) : blk(other.blk) {
+      if(blk != nullptr) blk->refcount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // noexcept, so std::vector moves handles rather than copying them
+    BufferHandle(BufferHandle && other) noexcept : blk(other.blk) {
+      other.blk = nullptr; 
+    }
+
+    BufferHandle & operator=(const BufferHandle & other) {
+      if(other.blk != nullptr) other.blk->refcount.fetch_add(1, std::memory_order_relaxed);
+      release();
+      blk = other.blk;
+      return *this; 
+    }
+
+    BufferHandle & operator=(BufferHandle && other) noexcept {
+      if(this != &other) {
+	release();
+	blk = other.blk;
+	other.blk = nullptr; 
+      }
+      return *this; 
+    }
+
+    ~BufferHandle() { release(); }
+
+    /**
+     * @brief Let go of the buffer. 
+     */
+    void reset() {
+      release();
+      blk = nullptr; 
+    }
+
+    /**
+     * @brief Where are the elements?
+     * @returns a pointer to the first element of the buffer.
+     */
+    T * data() const { return blk->data(); }
+
+    /**
+     * @brief How long is the buffer?
+     * @returns the number of elements asked for in getHandle()
+     */
+    size_t size() const { return blk->length; }
+
+    /**
+     * @brief How long could the buffer be?
+     * @returns the number of elements actually allocated, which may be
+     * more than size().
+     */
+    size_t capacity() const { return blk->capacity; }
+    
+    T & operator[](size_t i) const { return blk->data()[i]; }
+    T * begin() const { return blk->data(); }
+    T * end() const { return blk->data() + blk->length; }
+
+    /**
+     * @brief How many handles refer to this buffer?
+     * @returns the reference count (only a snapshot, of course).
+     */
+    int useCount() const {
+      return (blk == nullptr) ? 0 : blk->refcount.load(std::memory_order_relaxed);
+    }
+    
+    explicit operator bool() const { return blk != nullptr; }
+    bool operator==(const BufferHandle & other) const { return blk == other.blk; }
+    bool operator!=(const BufferHandle & other) const { return blk != other.blk; }
+    bool operator==(std::nullptr_t) const { return blk == nullptr; }
+    bool operator!=(std::nullptr_t) const { return blk != nullptr; }
+
+  private:
+    friend class BufferPool<T>;
+    
+    // adopt a block whose reference count has already been set. 
+    // (Not a constructor, as BufferHandle(0) must mean nullptr.)
+    static BufferHandle adopt(PoolBlock<T> * b) {
+      BufferHandle ret;
+      ret.blk = b;
+      return ret; 
+    }
+    
+    void release() {
+      if((blk != nullptr) && (blk->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)) {
+	blk->pool->recycleBlock(blk);
+      }
+    }
+    
+    PoolBlock<T> * blk; 
+  };
+  
   /**
    * @class BufferPool
    * 
@@ -103,9 +275,57 @@ namespace SoDa {
      * "filled" with this number of buffers each time it runs dry. Big
      * numbers reduce the likelihood of having to refill the pool. But
      * they also can consume space.
+     *
+     * @param magazine_size if non-zero, each thread keeps a private
+     * cache (a "magazine") of up to this many free buffers of each size. 
+     * Gets and releases are served from the calling thread's magazine 
+     * without taking the pool lock. The shared pool is only touched when
+     * a magazine runs dry (it is refilled with magazine_size/2 buffers)
+     * or overflows (half of it is flushed back), one lock per batch. 
+     * Note that a buffer is returned to the magazine of the thread that 
+     * releases it, not the one that allocated it.  Magazine contents
+     * count as idle, and trim() has them emptied (see trim()). 
+     *
+     * @param use_size_classes if true, buffers are carved from a
+     * set of geometric size classes (see sizeClassIndex()) rather than
+     * an exact-size pool per length. A request is served from the
+     * smallest class that fits, so variable length workloads share
+     * a handful of free lists.  The class table is a flat array, so
+     * finding the right list is O(1). 
      */
-    BufferPool(std::string name, size_t pool_refill_size) :
-      pool_refill_size(pool_refill_size), name(name) {
+    BufferPool(std::string name, size_t pool_refill_size, size_t magazine_size = 0, 
+	       bool use_size_classes = false) :
+      pool_refill_size(pool_refill_size), name(name), idle_bytes(0), max_idle_bytes(0), magazine_bytes(0), flush_epoch(0), 
+      storage(std::make_shared<AlignedStorage>()),
+      vec_store(this, pool_refill_size, magazine_size, use_size_classes,
+		[](size_t n) { return std::make_shared<std::vector<T>>(n); }) {
+      makeBlockStores(magazine_size, use_size_classes);
+    }
+
+    /**
+     * @brief Create a buffer pool whose getHandle() blocks come from
+     * a particular kind of storage. 
+     *
+     * @param name the name of the pool
+     * @param pool_refill_size see above
+     * @param storage where to get the memory for buffer blocks -- 
+     * a SoDa::AlignedStorage or SoDa::MMapStorage, perhaps. If the 
+     * storage is NUMA local, the pool keeps a separate set of free
+     * lists for each NUMA node, and each thread gets buffers from the
+     * lists for the node it is running on. The storage may be shared
+     * with other pools. 
+     * @param magazine_size see above
+     * @param use_size_classes see above
+     *
+     * Buffers from getFromPool() still come from std::vector's allocator. 
+     */
+    BufferPool(std::string name, size_t pool_refill_size, std::shared_ptr<BufferStorage> storage,
+	       size_t magazine_size = 0, bool use_size_classes = false) :
+      pool_refill_size(pool_refill_size), name(name), idle_bytes(0), max_idle_bytes(0), magazine_bytes(0), flush_epoch(0), 
+      storage(storage), 
+      vec_store(this, pool_refill_size, magazine_size, use_size_classes,
+		[](size_t n) { return std::make_shared<std::vector<T>>(n); }) {
+      makeBlockStores(magazine_size, use_size_classes);
     }
 
     /**
@@ -158,8 +378,8 @@ namespace SoDa {
       }
 
       PoolAllocatedBuffer(BufferPool<T> * bp, 
-			  std::shared_ptr<std::vector<T>> & vp) :
-	Buffer<T>(vp) {
+			  std::shared_ptr<std::vector<T>> & vp, size_t n) :
+	Buffer<T>(vp, n) {
 	//	std::cerr << "allocating " << vp << " from pool\n";	
 	from_pool = bp; 
       }
@@ -181,73 +401,634 @@ namespace SoDa {
       BufferPool<T> * from_pool;
     };
 
-    // mutual exclusion stuff
-    std::mutex allocation_mtx; 
+  public:
+    /**
+     * @brief A snapshot of the pool's counters. See snapshot().
+     *
+     * Everything but the idle byte counts is zero unless
+     * the pool was compiled with SODA_IPC_STATS.
+     */
+    struct Stats {
+      bool enabled;         ///< were the counters compiled in?
+      uint64_t gets;        ///< buffers handed out by getFromPool() and getHandle()
+      uint64_t returns;     ///< buffers that came back
+      uint64_t outstanding; ///< buffers handed out and not yet back
+      uint64_t refills;     ///< times a free list ran dry and was filled
+      uint64_t allocated;   ///< buffers created to fill free lists
+      uint64_t freed;       ///< buffers released by trim() or the idle limit
+      size_t idle_bytes;    ///< see idleBytes()
+      size_t magazine_bytes; ///< the part of idle_bytes in per-thread magazines
+      /// buffer capacity (in elements) -> bytes idle in the shared free lists
+      std::map<size_t, size_t> idle_bytes_by_size;
+      /// allocation lock waits -- see SoDa::LockWaitHistogram
+      std::vector<uint64_t> lock_wait;
+    };
+
+  private:
+    /**
+     * @brief Inside baseball: free lists of pooled items, keyed by size,
+     * along with the per-thread magazines that sit in front of them. 
+     *
+     * The pool keeps one of these for the std::vectors that back
+     * getFromPool() buffers, and one for the blocks that back
+     * getHandle() buffers. 
+     *
+     * Items are filed under a key.  When the pool is using exact
+     * sizes, the key is the element count and the free lists live in a
+     * map.  When the pool is using size classes, the key is the class
+     * index and the free lists live in a flat table indexed by it.
+     *
+     * @tparam Item the thing being pooled. 
+     */
+    template <typename Item>
+    class FreeStore {
+    public:
+      FreeStore(BufferPool * bp, size_t refill_size, size_t magazine_size, bool use_size_classes, 
+		std::function<Item(size_t)> make_item,
+		std::function<void(Item &)> destroy_item = std::function<void(Item &)>()) :
+	bp(bp), refill_size(refill_size), magazine_size(magazine_size), 
+	use_size_classes(use_size_classes),
+	make_item(make_item), destroy_item(destroy_item) {
+	if(use_size_classes) {
+	  class_lists.resize(NUM_SIZE_CLASSES);
+	}
+	if(magazine_size > 0) {
+	  // made up front, so trim() and idleBytes() can look at every
+	  // cache without racing the thread that would have created it.
+	  for(int i = 0; i < ThreadSlot::MAX_SLOTS; i++) {
+	    thread_caches.push_back(std::unique_ptr<ThreadCache>(new ThreadCache));
+	  }
+	  if(statsEnabled()) shards.resize(ThreadSlot::MAX_SLOTS);
+	}
+      }
+
+      ~FreeStore() {
+	for(auto & fl : exact_lists) destroyAll(fl.second);
+	for(auto & fl : class_lists) destroyAll(fl);
+	for(auto & tc : thread_caches) {
+	  for(auto & mag : tc->magazines) destroyAll(mag.second);
+	  for(auto & mag : tc->class_magazines) destroyAll(mag);
+	}
+      }
+
+      /**
+       * @brief Which free list do buffers of n elements come from?
+       */
+      size_t keyFor(size_t n) const {
+	return use_size_classes ? sizeClassIndex(n) : n;
+      }
+
+      /**
+       * @brief How many elements are in the buffers on a free list? 
+       */
+      size_t capacityFor(size_t key) const {
+	return use_size_classes ? sizeClassCapacity(key) : key;
+      }
+      
+      Item take(size_t key) {
+	if(magazine_size > 0) {
+	  ThreadCache * tc = getThreadCache();
+	  if(tc != nullptr) {
+	    checkFlush(*tc);
+	    Magazine & mag = tc->getMagazine(key, use_size_classes);
+	    if(mag.empty()) refillMagazine(*tc, mag, key);
+	    Item ret = std::move(mag.back());
+	    mag.pop_back();
+	    tc->addBytes(-itemBytes(key));
+	    if(statsEnabled()) shards[ThreadSlot::get()].gets.bump();
+	    return ret;
+	  }
+	}
+
+	TimedLockGuard<std::mutex> lock(allocation_mtx, bp->lock_wait);
+	gets.bump();
+	FreeList & free_list = *getFreeList(key, true);
+	if(free_list.empty()) fill(free_list, key);
+	// take the most recently pushed -- as it may
+	// still be in the TLBs and caches.
+	Item ret = std::move(free_list.front());
+	free_list.pop_front();
+	bp->idle_bytes -= itemBytes(key);
+	return ret; 
+      }
+
+      void give(size_t key, Item item) {
+	if(magazine_size > 0) {
+	  ThreadCache * tc = getThreadCache();
+	  if(tc != nullptr) {
+	    checkFlush(*tc);
+	    Magazine & mag = tc->getMagazine(key, use_size_classes);
+	    mag.push_back(std::move(item));
+	    tc->addBytes(itemBytes(key));
+	    if(statsEnabled()) shards[ThreadSlot::get()].returns.bump();
+	    if(overBudget(*tc)) {
+	      // this thread is sitting on too much -- send its magazines
+	      // back, where the idle limit applies.
+	      flushThreadCache(*tc);
+	    }
+	    else if(mag.size() > magazine_size) {
+	      flushMagazine(*tc, mag, key, magazine_size / 2);
+	    }
+	    return;
+	  }
+	}
+
+	TimedLockGuard<std::mutex> lock(allocation_mtx, bp->lock_wait);
+	FreeList * free_list = getFreeList(key, false); 
+	if(free_list == nullptr) {
+	  // whoa!  That's not right.
+	  throw ReturnPointerException(bp);
+	}
+	returns.bump();
+	free_list->push_front(std::move(item));
+	bp->idle_bytes += itemBytes(key);
+	enforceIdleLimit(*free_list, key);
+      }
+
+      /**
+       * @brief Empty the calling thread's magazines, and those left
+       * behind by threads that have exited, into the shared free
+       * lists.  Other live threads empty their own when they next
+       * notice the pool's flush epoch has moved (see checkFlush()).
+       */
+      void flushAllMagazines() {
+	if(magazine_size == 0) return; 
+	uint64_t epoch = bp->flush_epoch.load(std::memory_order_relaxed);
+	ThreadCache * mine = getThreadCache();
+	if(mine != nullptr) {
+	  mine->seen_epoch = epoch;
+	  flushThreadCache(*mine);
+	}
+	ThreadSlot::forEachIdle([this, epoch](int slot) {
+	    if((slot < 0) || (slot >= int(thread_caches.size()))) return;
+	    thread_caches[slot]->seen_epoch = epoch;
+	    flushThreadCache(*thread_caches[slot]);
+	  });
+      }
+
+      /**
+       * @brief How many bytes of element storage are parked in the
+       * per-thread magazines?
+       */
+      size_t magazineBytes() const {
+	size_t ret = 0;
+	for(auto & tc : thread_caches) ret += tc->bytes.load(std::memory_order_relaxed);
+	return ret;
+      }
+
+      /**
+       * @brief Release idle items from the free lists, biggest sizes
+       * first, until the pool holds no more than keep_bytes idle. 
+       * Call flushAllMagazines() first to include the magazines.
+       */
+      void trim(size_t keep_bytes) {
+	TimedLockGuard<std::mutex> lock(allocation_mtx, bp->lock_wait);
+	for(auto it = class_lists.rbegin(); it != class_lists.rend(); ++it) {
+	  size_t key = class_lists.size() - 1 - (it - class_lists.rbegin());
+	  trimList(*it, key, keep_bytes);
+	}
+	for(auto it = exact_lists.rbegin(); it != exact_lists.rend(); ++it) {
+	  trimList(it->second, it->first, keep_bytes);
+	}
+      }
+
+      /**
+       * @brief Add this store's counters, and the bytes sitting in
+       * its free lists, to a pool snapshot.
+       */
+      void addStats(Stats & st) {
+	std::lock_guard<std::mutex> lock(allocation_mtx);
+	st.gets += gets.get();
+	st.returns += returns.get();
+	st.refills += refills.get();
+	st.allocated += allocated.get();
+	st.freed += freed.get();
+	for(auto & sh : shards) {
+	  st.gets += sh.gets.get();
+	  st.returns += sh.returns.get();
+	}
+	for(size_t key = 0; key < class_lists.size(); key++) {
+	  if(!class_lists[key].empty()) {
+	    st.idle_bytes_by_size[capacityFor(key)] += class_lists[key].size() * itemBytes(key);
+	  }
+	}
+	for(auto & fl : exact_lists) {
+	  if(!fl.second.empty()) {
+	    st.idle_bytes_by_size[fl.first] += fl.second.size() * itemBytes(fl.first);
+	  }
+	}
+      }
+      
+    private:
+      typedef std::deque<Item> FreeList;
+      BufferPool * bp; 
+      size_t refill_size;
+      size_t magazine_size; 
+      bool use_size_classes; 
+      std::function<Item(size_t)> make_item;
+      std::function<void(Item &)> destroy_item;
+      
+      // mutual exclusion stuff
+      std::mutex allocation_mtx; 
+      std::map<size_t, FreeList> exact_lists;
+      std::vector<FreeList> class_lists; 
+      
+      // Per-thread magazines, indexed by SoDa::ThreadSlot.  Each cache
+      // is only touched by the thread that owns the slot -- or, once
+      // that thread has exited, by trim() while ThreadSlot won't hand
+      // the slot to anybody else.  So there's no lock here.  bytes is
+      // written by whoever is touching the cache, but idleBytes()
+      // reads it from anywhere.
+      typedef std::vector<Item> Magazine;
+      struct ThreadCache {
+	ThreadCache() : bytes(0), synced_bytes(0), seen_epoch(0) { }
+	std::atomic<size_t> bytes;
+	size_t synced_bytes; // how much of bytes the pool's magazine_bytes knows about
+	uint64_t seen_epoch; // the pool's flush epoch when we last flushed
+	std::map<size_t, Magazine> magazines; 
+	std::vector<Magazine> class_magazines; 
+
+	Magazine & getMagazine(size_t key, bool use_size_classes) {
+	  if(use_size_classes) {
+	    if(class_magazines.empty()) class_magazines.resize(NUM_SIZE_CLASSES);
+	    return class_magazines[key];
+	  }
+	  return magazines[key];
+	}
+
+	void addBytes(size_t delta) {
+	  // unsigned wraparound does the right thing for a "negative" delta
+	  bytes.store(bytes.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+	}
+      };
+      std::vector<std::unique_ptr<ThreadCache>> thread_caches; 
+
+      // Statistics. The shared counters are only written with
+      // allocation_mtx held, and each shard only by the thread that
+      // owns the slot, so nobody pays for an atomic add.
+      StatCounter gets, returns, refills, allocated, freed;
+      struct Shard {
+	StatCounter gets, returns;
+	char pad[64 - 2 * sizeof(StatCounter)];
+      };
+      std::vector<Shard> shards; 
+
+      size_t itemBytes(size_t key) const { return capacityFor(key) * sizeof(T); }
+      
+      FreeList * getFreeList(size_t key, bool create) {
+	if(use_size_classes) return &class_lists[key];
+	if(create) return &exact_lists[key];
+	auto flit = exact_lists.find(key);
+	return (flit == exact_lists.end()) ? nullptr : &(flit->second);
+      }
+      
+      void destroyAll(std::vector<Item> & items) {
+	if(destroy_item) for(auto & it : items) destroy_item(it);
+      }
+      void destroyAll(FreeList & items) {
+	if(destroy_item) for(auto & it : items) destroy_item(it);
+      }
+
+      // these are only called with allocation_mtx held.
+      void fill(FreeList & free_list, size_t key) {
+	if(free_list.size() < refill_size) refills.bump();
+	while(free_list.size() < refill_size) {
+	  free_list.push_back(make_item(capacityFor(key)));
+	  allocated.bump();
+	  bp->idle_bytes += itemBytes(key);
+	}
+	if(free_list.empty()) {
+	  throw FillPoolException(bp);
+	}
+      }
+
+      void trimList(FreeList & free_list, size_t key, size_t keep_bytes) {
+	// the coldest items are at the back. 
+	while(!free_list.empty() && (bp->idle_bytes > keep_bytes)) {
+	  if(destroy_item) destroy_item(free_list.back());
+	  free_list.pop_back();
+	  freed.bump();
+	  bp->idle_bytes -= itemBytes(key);
+	}
+      }
+
+      // The magazines count toward the idle limit, so the shared
+      // lists only get what the magazines leave.  The running total
+      // can be behind by whatever each thread has moved through its
+      // magazines since its last refill or flush -- a few buffers.
+      void enforceIdleLimit(FreeList & free_list, size_t key) {
+	size_t max_idle = bp->max_idle_bytes.load(std::memory_order_relaxed);
+	if(max_idle == 0) return; 
+	size_t mag_bytes = bp->magazine_bytes.load(std::memory_order_relaxed);
+	trimList(free_list, key, (max_idle > mag_bytes) ? (max_idle - mag_bytes) : 0);
+      }
+
+      // With an idle limit, each thread's magazines may hold a quarter
+      // of it, so a few busy threads can't sit on the whole allowance.
+      // A thread that would take the pool past the limit flushes too. 
+      bool overBudget(ThreadCache & tc) {
+	size_t max_idle = bp->max_idle_bytes.load(std::memory_order_relaxed);
+	if(max_idle == 0) return false; 
+	size_t mine = tc.bytes.load(std::memory_order_relaxed);
+	return (mine > max_idle / 4) || 
+	  (mine + bp->idle_bytes.load(std::memory_order_relaxed) > max_idle);
+      }
+      
+      // trim() can't touch a live thread's magazines, so it moves the
+      // pool's flush epoch, and each thread empties its own magazines
+      // the next time it gets or releases a buffer.
+      void checkFlush(ThreadCache & tc) {
+	uint64_t epoch = bp->flush_epoch.load(std::memory_order_relaxed);
+	if(tc.seen_epoch != epoch) {
+	  tc.seen_epoch = epoch;
+	  flushThreadCache(tc);
+	}
+      }
+
+      ThreadCache * getThreadCache() {
+	int slot = ThreadSlot::get();
+	if((slot < 0) || (slot >= int(thread_caches.size()))) return nullptr;
+	return thread_caches[slot].get();
+      }
+
+      void refillMagazine(ThreadCache & tc, Magazine & mag, size_t key) {
+	TimedLockGuard<std::mutex> lock(allocation_mtx, bp->lock_wait);
+	size_t want = (magazine_size + 1) / 2;
+	FreeList & free_list = *getFreeList(key, true);
+	if(free_list.size() < want) fill(free_list, key);
+	while((mag.size() < want) && !free_list.empty()) {
+	  mag.push_back(std::move(free_list.front()));
+	  free_list.pop_front();
+	  bp->idle_bytes -= itemBytes(key);
+	  tc.addBytes(itemBytes(key));
+	}
+	syncBytes(tc);
+      }
+
+      // tell the pool's running total what this cache has done since
+      // the last refill or flush.
+      void syncBytes(ThreadCache & tc) {
+	size_t now = tc.bytes.load(std::memory_order_relaxed);
+	// unsigned wraparound takes care of a shrinking cache
+	bp->magazine_bytes.fetch_add(now - tc.synced_bytes, std::memory_order_relaxed);
+	tc.synced_bytes = now;
+      }
+
+      void flushThreadCache(ThreadCache & tc) {
+	for(auto & mag : tc.magazines) {
+	  if(!mag.second.empty()) flushMagazine(tc, mag.second, mag.first, 0);
+	}
+	for(size_t key = 0; key < tc.class_magazines.size(); key++) {
+	  if(!tc.class_magazines[key].empty()) flushMagazine(tc, tc.class_magazines[key], key, 0);
+	}
+      }
 
+      // send all but the keep most recent items back to the shared
+      // list.
+      void flushMagazine(ThreadCache & tc, Magazine & mag, size_t key, size_t keep) {
+	TimedLockGuard<std::mutex> lock(allocation_mtx, bp->lock_wait);
+	FreeList * free_list = getFreeList(key, true); 
+	// send back the oldest, keep the warm ones.
+	size_t send = (mag.size() > keep) ? (mag.size() - keep) : 0; 
+	for(size_t i = 0; i < send; i++) {
+	  free_list->push_front(std::move(mag[i]));
+	  bp->idle_bytes += itemBytes(key);
+	  tc.addBytes(-itemBytes(key));
+	}
+	mag.erase(mag.begin(), mag.begin() + send);
+	syncBytes(tc);
+	enforceIdleLimit(*free_list, key);
+      }
+    };
+    
   public:
+    /**
+     * @brief The number of entries in a size class table. 
+     */
+    static const size_t NUM_SIZE_CLASSES = 256;
+    
+    /**
+     * @brief Which size class holds a buffer of n elements?
+     *
+     * Everything up to 16 elements is in class 0.  Above that, each
+     * power of two is split into four classes, so a buffer is never
+     * more than 25% bigger than the caller asked for. 
+     *
+     * @param n the number of elements asked for
+     * @returns the index of the smallest class that will hold n elements
+     */
+    static size_t sizeClassIndex(size_t n) {
+      if(n <= 16) return 0;
+      size_t k = 0;
+      size_t m = n - 1;
+      while(m >>= 1) k++;
+      // now 2^k < n <= 2^(k+1)
+      size_t quarter = (size_t(1) << k) >> 2;
+      size_t sub = ((n - 1) - (size_t(1) << k)) / quarter;
+      return 1 + (k - 4) * 4 + sub; 
+    }
+
+    /**
+     * @brief How many elements are in the buffers of a size class?
+     *
+     * @param idx the size class index
+     * @returns the capacity of a buffer in that class
+     */
+    static size_t sizeClassCapacity(size_t idx) {
+      if(idx == 0) return 16;
+      size_t k = 4 + (idx - 1) / 4;
+      size_t sub = (idx - 1) % 4;
+      return (size_t(1) << k) + (sub + 1) * ((size_t(1) << k) >> 2);
+    }
+    
     /**
      * @brief Create a buffer. 
      * 
      * @param n The number of elements in the buffer's vector. 
      *
      * @returns A shared pointer to a buffer. The shared pointer
-     * is the trigger for releasing the buffer's storage. 
+     * is the trigger for releasing the buffer's storage. If the pool
+     * uses size classes, the vector may be longer than n -- 
+     * the buffer's size() method still reports n. 
      */
     //    std::shared_ptr<PoolAllocatedBuffer> getFromPool(size_t n) {
     std::shared_ptr<Buffer<T>> getFromPool(size_t n) {    
-      std::lock_guard<std::mutex> lock(allocation_mtx);
-      bool second_try = false; 
-
-#if 1 // ENABLE_POOL      
-      while(1) {
-	if(pool.count(n) > 0) {
-	  if(pool[n].size() <= 0) fillPool(n);
-	
-	  auto r = pool[n].front();
-	  // take the most recently pushed -- as it may
-	  // still be in the TLBs and caches.
-	  pool[n].pop_front();
-	  return std::make_shared<PoolAllocatedBuffer>(this, r);
-	}
-	else {
-	  if(second_try) {
-	    throw FillPoolException(this);
-	  }
-	  second_try = true; 
-	  pool[n] = std::deque<std::shared_ptr<std::vector<T>>>();
-	  fillPool(n); 
-	}
-      }
-#else
-      return std::make_shared<Buffer<T>>(n);      
-#endif
+      auto r = vec_store.take(vec_store.keyFor(n));
+      return std::make_shared<PoolAllocatedBuffer>(this, r, n);
+    }
+
+    /**
+     * @brief Create a buffer without allocating anything. 
+     *
+     * The buffer's header and elements come out of the pool as a
+     * single block, and the block (not just the elements) goes back
+     * to the pool when the last handle to it is released. 
+     * 
+     * Like the buffers from getFromPool(), the elements are
+     * whatever the last user left behind. 
+     *
+     * @param n The number of elements in the buffer. 
+     *
+     * @returns A handle to the buffer. 
+     */
+    BufferHandle<T> getHandle(size_t n) {
+      int node = numa_local ? BufferStorage::currentNode() : 0;
+      if(node >= int(block_stores.size())) node = 0;
+      FreeStore<PoolBlock<T> *> & block_store = *block_stores[node];
+      PoolBlock<T> * b = block_store.take(block_store.keyFor(n));
+      b->refcount.store(1, std::memory_order_relaxed);
+      b->length = n;
+      return BufferHandle<T>::adopt(b);
+    }
+
+    /**
+     * @brief Put a ceiling on the idle storage held by the pool. 
+     *
+     * When a released buffer would push the idle total over the limit,
+     * buffers are freed instead of pooled.  Buffers in per-thread
+     * magazines count toward the limit, and each thread may hold at
+     * most a quarter of it before its magazines are flushed. 
+     *
+     * @param max_bytes the limit in bytes of element storage.  Zero
+     * (the default) means no limit. 
+     */
+    void setMaxIdleBytes(size_t max_bytes) {
+      max_idle_bytes.store(max_bytes, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Free idle buffers, biggest first. 
+     *
+     * The calling thread's magazines, and those left behind by
+     * threads that have exited, are emptied into the free lists
+     * first.  Other live threads' magazines can only be touched by
+     * their owners, so they are asked to empty them and do so the
+     * next time they get or release a buffer from this pool.
+     * 
+     * @param keep_bytes stop when no more than this many bytes of
+     * element storage are left idle. 
+     */
+    void trim(size_t keep_bytes = 0) {
+      flush_epoch.fetch_add(1, std::memory_order_relaxed);
+      vec_store.flushAllMagazines();
+      for(auto & bs : block_stores) bs->flushAllMagazines();
+      vec_store.trim(keep_bytes);
+      for(auto & bs : block_stores) bs->trim(keep_bytes);
+    }
+
+    /**
+     * @brief How much element storage is sitting idle in the pool?
+     * @returns the number of idle bytes in the free lists and the
+     * per-thread magazines.
+     */
+    size_t idleBytes() const {
+      return idle_bytes.load(std::memory_order_relaxed) + magazineBytes();
+    }
+
+    /**
+     * @brief How much of idleBytes() is parked in per-thread magazines?
+     */
+    size_t magazineBytes() const {
+      size_t ret = vec_store.magazineBytes();
+      for(auto & bs : block_stores) ret += bs->magazineBytes();
+      return ret;
+    }
+
+    /**
+     * @brief Collect the pool's counters.
+     *
+     * The counters are cheap enough to leave on in production, and
+     * disappear entirely when SODA_IPC_STATS isn't defined. The hit
+     * rate is 1 - allocated / gets. A buffer counts as a get when a
+     * caller takes it and as a return when the caller gives it back,
+     * so buffers moving between the magazines and the shared lists
+     * don't change outstanding.  Buffers in per-thread magazines are
+     * in idle_bytes and magazine_bytes, but not idle_bytes_by_size.
+     *
+     * @returns a copy of the counters as of (roughly) now.
+     */
+    Stats snapshot() {
+      Stats st;
+      st.enabled = statsEnabled();
+      st.gets = st.returns = st.refills = st.allocated = st.freed = 0;
+      vec_store.addStats(st);
+      for(auto & bs : block_stores) bs->addStats(st);
+      st.outstanding = (st.gets > st.returns) ? (st.gets - st.returns) : 0;
+      st.magazine_bytes = magazineBytes();
+      st.idle_bytes = idleBytes();
+      st.lock_wait = lock_wait.get();
+      return st;
     }
     
   private:
-    std::map<int, std::deque<std::shared_ptr<std::vector<T>>>> pool;
+    friend class BufferHandle<T>;
+    
     size_t pool_refill_size;
     std::string name; 
 
-    // don't lock this, as it can only be called from getFromPool.
-    void fillPool(size_t n) {
-      if(pool.count(n) == 0) {
-	pool[n] = std::deque<std::shared_ptr<std::vector<T>>>();
-      }
+    std::atomic<size_t> idle_bytes;
+    std::atomic<size_t> max_idle_bytes; 
+    // a running total of what the magazines hold, brought up to date
+    // each time a magazine is refilled or flushed.  Cheap enough to
+    // check on every flush, unlike adding up every thread's cache.
+    std::atomic<size_t> magazine_bytes;
+    // moved by trim() to ask live threads to empty their magazines
+    std::atomic<uint64_t> flush_epoch;
+    // waits for the free store allocation locks
+    LockWaitHistogram lock_wait;
+    
+    // the storage must outlive the block stores, as they give their
+    // blocks back to it when they're destroyed. 
+    std::shared_ptr<BufferStorage> storage;
+    bool numa_local; 
+    
+    FreeStore<std::shared_ptr<std::vector<T>>> vec_store;
+    // one block store per NUMA node (just one if the storage isn't NUMA local)
+    std::vector<std::unique_ptr<FreeStore<PoolBlock<T> *>>> block_stores;
 
-      while(pool[n].size() < pool_refill_size) {
-	pool[n].push_back(std::make_shared<std::vector<T>>(n));
+    void makeBlockStores(size_t magazine_size, bool use_size_classes) {
+      numa_local = storage->numaLocal();
+      int num_nodes = numa_local ? BufferStorage::numNodes() : 1;
+      for(int node = 0; node < num_nodes; node++) {
+	block_stores.push_back(std::unique_ptr<FreeStore<PoolBlock<T> *>>(
+	    new FreeStore<PoolBlock<T> *>(this, pool_refill_size, magazine_size, use_size_classes, 
+					  [this, node](size_t n) { return allocBlock(n, node); },
+					  [this](PoolBlock<T> * & b) { freeBlock(b); })));
       }
     }
     
+    PoolBlock<T> * allocBlock(size_t n, int node) {
+      size_t header_bytes = PoolBlock<T>::headerBytes(storage->alignment());
+      void * mem = storage->allocate(header_bytes + n * sizeof(T), numa_local ? node : -1);
+      PoolBlock<T> * b = new (mem) PoolBlock<T>;
+      b->refcount.store(0, std::memory_order_relaxed);
+      b->pool = this;
+      b->size_key = block_stores[0]->keyFor(n);
+      b->length = n;
+      b->capacity = n;
+      b->node = node; 
+      b->payload_offset = header_bytes; 
+      // construct the elements here, so that the first touch happens on
+      // the node that asked for the buffer.
+      T * d = b->data();
+      for(size_t i = 0; i < n; i++) new (d + i) T();
+      return b; 
+    }
+
+    void freeBlock(PoolBlock<T> * b) {
+      T * d = b->data();
+      for(size_t i = 0; i < b->capacity; i++) d[i].~T();
+      size_t bytes = b->blockBytes();
+      b->~PoolBlock<T>();
+      storage->deallocate(b, bytes);
+    }
+    
+    void recycleBlock(PoolBlock<T> * b) {
+      block_stores[b->node]->give(b->size_key, b);
+    }
+    
     void returnToPool(std::shared_ptr<std::vector<T>> & p, size_t n) {
-      std::lock_guard<std::mutex> lock(allocation_mtx);            
-      if(pool.count(n) > 0) {
-	pool[n].push_front(p);
-      }
-      else {
-	// whoa!  That's not right.
-	throw ReturnPointerException(this);
-      }
+      vec_store.give(vec_store.keyFor(n), p);
     }
   };
 }
@@ -0,0 +1,472 @@
+#pragma once
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <cstdlib>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef SODA_IPC_HAVE_NUMA
+#include <numa.h>
+#endif
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file BufferStorage.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+/**
+ * @page SoDa::BufferStorage Where SoDa::BufferPool gets its memory
+ *
+ * A SoDa::BufferPool gets the blocks behind its SoDa::BufferHandle
+ * buffers from a BufferStorage object.  There are two flavors:
+ *
+ *  - SoDa::AlignedStorage -- heap storage with any power-of-two
+ *    alignment (64 bytes by default, good for SIMD kernels).
+ *  - SoDa::MMapStorage -- page-aligned slabs from mmap, optionally
+ *    backed by huge pages (MAP_HUGETLB, or transparent huge pages
+ *    via madvise), optionally locked in memory with mlock, and
+ *    optionally bound to the NUMA node of the thread that asked for
+ *    them.
+ *
+ * A storage object that says it is NUMA local (see numaLocal())
+ * makes the pool keep a separate set of free lists for each NUMA
+ * node.  A thread is always handed buffers from its own node's
+ * lists.
+ *
+ * NUMA support comes from libnuma when the code is built with
+ * SODA_IPC_HAVE_NUMA defined.  Without it (or on a machine where
+ * libnuma says NUMA isn't available) everything is on node 0, and
+ * the per-node machinery quietly collapses to a single pool.
+ */
+
+namespace SoDa {
+
+  /**
+   * @brief The storage backend couldn't get (or lock) the memory.
+   */
+  class BufferStorageException : public std::runtime_error {
+  public:
+    BufferStorageException(const std::string & problem) :
+      std::runtime_error("SoDa::BufferStorage " + problem) {
+    }
+  };
+
+  /**
+   * @class BufferStorage
+   * @brief Where a SoDa::BufferPool gets the memory for its blocks.
+   *
+   * Implementations must be thread safe -- several pools may share
+   * one storage object.
+   */
+  class BufferStorage {
+  public:
+    virtual ~BufferStorage() { }
+
+    /**
+     * @brief Get some memory.
+     *
+     * @param bytes how much
+     * @param numa_node the node the memory should live on, or -1 for
+     * "don't care."
+     * @returns a pointer to memory aligned to at least alignment() bytes.
+     */
+    virtual void * allocate(size_t bytes, int numa_node) = 0;
+
+    /**
+     * @brief Give memory back.
+     *
+     * @param p the pointer that allocate() returned
+     * @param bytes the size passed to allocate()
+     */
+    virtual void deallocate(void * p, size_t bytes) = 0;
+
+    /**
+     * @brief How well aligned is the memory from allocate()?
+     * @returns the alignment in bytes.
+     */
+    virtual size_t alignment() const = 0;
+
+    /**
+     * @brief Should the pool keep separate free lists per NUMA node?
+     * @returns true if this storage tries to put memory on the
+     * caller's node.
+     */
+    virtual bool numaLocal() const = 0;
+
+    /**
+     * @brief How many NUMA nodes are there?
+     * @returns one more than the highest node number, or 1 if we
+     * don't know (or don't care).  Node numbers can be sparse, so
+     * this may count nodes that don't exist -- callers index per-node
+     * tables by node number.
+     */
+    static int numNodes() {
+#ifdef SODA_IPC_HAVE_NUMA
+      if(numa_available() >= 0) {
+	int n = numa_max_node() + 1;
+	return (n > 0) ? n : 1;
+      }
+#endif
+      return 1;
+    }
+
+    /**
+     * @brief Which NUMA node is the calling thread running on?
+     * @returns the node number, or 0 if we don't know.
+     */
+    static int currentNode() {
+#ifdef SODA_IPC_HAVE_NUMA
+      if(numa_available() >= 0) {
+	int cpu = sched_getcpu();
+	int node = (cpu < 0) ? 0 : numa_node_of_cpu(cpu);
+	return (node < 0) ? 0 : node;
+      }
+#endif
+      return 0;
+    }
+  };
+
+  /**
+   * @class AlignedStorage
+   * @brief Heap storage with a guaranteed alignment.
+   *
+   * If numa_local is set, the pool keeps per-node free lists, and
+   * relies on the kernel's first-touch policy to place fresh memory
+   * on the node of the thread that fills the pool.
+   */
+  class AlignedStorage : public BufferStorage {
+  public:
+    /**
+     * @param alignment a power of two, at least sizeof(void*)
+     * @param numa_local keep per-node free lists in the pool
+     */
+    AlignedStorage(size_t alignment = 64, bool numa_local = false) :
+      align(alignment), numa_local(numa_local) {
+      if((align < sizeof(void*)) || ((align & (align - 1)) != 0)) {
+	throw BufferStorageException("AlignedStorage alignment " + std::to_string(align) +
+				     " is not a power of two at least as big as a pointer.");
+      }
+    }
+
+    void * allocate(size_t bytes, int numa_node) {
+      (void) numa_node;
+      void * ret = nullptr;
+      if(posix_memalign(&ret, align, bytes) != 0) {
+	throw BufferStorageException("AlignedStorage couldn't allocate " + std::to_string(bytes) + " bytes.");
+      }
+      return ret;
+    }
+
+    void deallocate(void * p, size_t bytes) {
+      (void) bytes;
+      free(p);
+    }
+
+    size_t alignment() const { return align; }
+    bool numaLocal() const { return numa_local; }
+
+  private:
+    size_t align;
+    bool numa_local;
+  };
+
+  /**
+   * @class MMapStorage
+   * @brief Page-aligned storage from mmap: huge pages, locked pages,
+   * and NUMA placement.
+   *
+   * Memory is mapped in slabs (at least slab_bytes, and a whole
+   * number of pages).  Each request is rounded up to a size class
+   * (four per power of two) and carved off the end of the current
+   * slab for its node, so allocations of every size share the same
+   * slabs and small blocks don't each burn a page.  Returned chunks
+   * are kept on a free list for their class, and a slab goes back to
+   * the kernel as soon as all of its chunks have been returned -- so
+   * when a pool trims itself, the memory really goes away.
+   * Allocations bigger than a quarter of a slab get their own
+   * mapping, which is unmapped when they are returned.
+   *
+   * If MAP_HUGETLB is asked for but the system has no huge pages
+   * reserved, the slab is mapped with normal pages and the kernel is
+   * asked (via madvise) to back it with transparent huge pages instead.
+   */
+  class MMapStorage : public BufferStorage {
+  public:
+    /**
+     * @param huge_pages back the slabs with huge pages if we can.
+     * @param lock_pages mlock the slabs so they never page out. This
+     * usually needs a generous RLIMIT_MEMLOCK (or CAP_IPC_LOCK).
+     * @param numa_local bind each slab to the NUMA node of the thread
+     * that asked for it, and have the pool keep per-node free lists.
+     * @param slab_bytes the smallest mapping to ask the kernel for.
+     */
+    MMapStorage(bool huge_pages = false, bool lock_pages = false, bool numa_local = false,
+		size_t slab_bytes = 2 * 1024 * 1024) :
+      huge_pages(huge_pages), lock_pages(lock_pages), numa_local(numa_local), got_hugetlb(false),
+      mapped_bytes(0) {
+      page_size = sysconf(_SC_PAGESIZE);
+      map_granule = huge_pages ? hugePageSize() : page_size;
+      this->slab_bytes = roundUp(slab_bytes, map_granule);
+    }
+
+    ~MMapStorage() {
+      for(auto & s : slabs) unmap(s.first, s.second.len);
+      for(auto & b : big_chunks) unmap(b.first, b.second);
+    }
+
+    void * allocate(size_t bytes, int numa_node) {
+      std::lock_guard<std::mutex> lock(mtx);
+      size_t chunk = classBytes(bytes);
+      if(chunk > slab_bytes / 4) {
+	size_t len = roundUp(bytes, map_granule);
+	char * ret = mapSlab(len, numa_node);
+	big_chunks[ret] = len;
+	return ret;
+      }
+
+      int node = numa_local ? numa_node : -1; 
+      ChunkKey key(chunk, node);
+      char * ret;
+      std::vector<char*> & free_chunks = free_lists[key];
+      if(!free_chunks.empty()) {
+	ret = free_chunks.back();
+	free_chunks.pop_back();
+	findSlab(ret).live++;
+      }
+      else {
+	auto cit = current_slab.find(node);
+	if((cit == current_slab.end()) || (slabs[cit->second].used + chunk > slab_bytes)) {
+	  char * base = mapSlab(slab_bytes, numa_node);
+	  slabs[base] = Slab(slab_bytes, node);
+	  current_slab[node] = base;
+	  cit = current_slab.find(node);
+	}
+	Slab & slab = slabs[cit->second];
+	ret = cit->second + slab.used;
+	slab.used += chunk;
+	slab.live++;
+      }
+      chunk_owner[ret] = key;
+      return ret;
+    }
+
+    void deallocate(void * p, size_t bytes) {
+      (void) bytes;
+      std::lock_guard<std::mutex> lock(mtx);
+      char * cp = static_cast<char*>(p);
+      auto bit = big_chunks.find(cp);
+      if(bit != big_chunks.end()) {
+	unmap(cp, bit->second);
+	big_chunks.erase(bit);
+	return;
+      }
+      auto cit = chunk_owner.find(cp);
+      if(cit == chunk_owner.end()) {
+	throw BufferStorageException("MMapStorage was asked to free memory it didn't allocate.");
+      }
+      ChunkKey key = cit->second;
+      chunk_owner.erase(cit);
+      auto sit = findSlabIter(cp);
+      if(--(sit->second.live) == 0) {
+	releaseSlab(sit);
+      }
+      else {
+	free_lists[key].push_back(cp);
+      }
+    }
+
+    size_t alignment() const { return CHUNK_ALIGN; }
+    bool numaLocal() const { return numa_local; }
+
+    /**
+     * @brief Did we actually get MAP_HUGETLB pages?
+     * @returns true if at least one slab is backed by reserved huge pages.
+     */
+    bool gotHugeTLB() const { return got_hugetlb; }
+
+    /**
+     * @brief How much memory is mapped right now?
+     * @returns the total length of the live slabs and big mappings. 
+     */
+    size_t mappedBytes() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return mapped_bytes; 
+    }
+
+  private:
+    /**
+     * @brief the default huge page size, from the Hugepagesize line
+     * in /proc/meminfo, or 2MB if we can't find it.
+     */
+    static size_t hugePageSize() {
+      static const size_t size = readHugePageSize();
+      return size; 
+    }
+
+    static size_t readHugePageSize() {
+      std::ifstream meminfo("/proc/meminfo");
+      std::string line;
+      while(std::getline(meminfo, line)) {
+	if(line.compare(0, 13, "Hugepagesize:") != 0) continue;
+	std::istringstream ss(line.substr(13));
+	size_t kb = 0;
+	if((ss >> kb) && (kb > 0)) return kb * 1024;
+	break;
+      }
+      return 2 * 1024 * 1024;
+    }
+
+    static const size_t CHUNK_ALIGN = 64;
+
+    bool huge_pages;
+    bool lock_pages;
+    bool numa_local;
+    bool got_hugetlb;
+    size_t page_size;
+    size_t map_granule;
+    size_t slab_bytes;
+    size_t mapped_bytes; 
+
+    struct Slab {
+      Slab(size_t len = 0, int node = -1) : len(len), used(0), live(0), node(node) { }
+      size_t len;    // bytes mapped
+      size_t used;   // bytes carved off so far
+      size_t live;   // chunks handed out and not yet returned
+      int node;      // the node key, -1 if we aren't NUMA local
+    };
+    
+    std::mutex mtx;
+    typedef std::pair<size_t, int> ChunkKey; // class size, node
+    std::map<ChunkKey, std::vector<char*>> free_lists;
+    std::map<char*, ChunkKey> chunk_owner;
+    std::map<char*, Slab> slabs;          // by base address
+    std::map<int, char*> current_slab;    // the slab each node is carving from
+    std::map<char*, size_t> big_chunks;
+
+    // four classes per power of two, all multiples of CHUNK_ALIGN
+    static size_t classBytes(size_t bytes) {
+      if(bytes <= 4 * CHUNK_ALIGN) return roundUp((bytes == 0) ? 1 : bytes, CHUNK_ALIGN);
+      size_t p = 4 * CHUNK_ALIGN;
+      while((p << 1) <= bytes) p <<= 1;
+      return roundUp(bytes, p / 4);
+    }
+
+    std::map<char*, Slab>::iterator findSlabIter(char * p) {
+      auto it = slabs.upper_bound(p);
+      if(it == slabs.begin()) {
+	throw BufferStorageException("MMapStorage lost track of a slab.");
+      }
+      return --it; 
+    }
+
+    Slab & findSlab(char * p) { return findSlabIter(p)->second; }
+
+    // every chunk in the slab is back: drop them from the free lists
+    // and give the slab to the kernel.
+    void releaseSlab(std::map<char*, Slab>::iterator sit) {
+      char * base = sit->first;
+      char * end = base + sit->second.len;
+      int node = sit->second.node;
+      for(auto & fl : free_lists) {
+	if(fl.first.second != node) continue; 
+	std::vector<char*> & v = fl.second;
+	v.erase(std::remove_if(v.begin(), v.end(), 
+			       [base, end](char * c) { return (c >= base) && (c < end); }),
+		v.end());
+      }
+      auto cit = current_slab.find(node);
+      if((cit != current_slab.end()) && (cit->second == base)) current_slab.erase(cit);
+      unmap(base, sit->second.len);
+      slabs.erase(sit);
+    }
+
+    void unmap(char * p, size_t len) {
+      munmap(p, len);
+      mapped_bytes -= len; 
+    }
+
+    static size_t roundUp(size_t v, size_t granule) {
+      return ((v + granule - 1) / granule) * granule;
+    }
+
+    char * mapSlab(size_t len, int numa_node) {
+      void * ret = MAP_FAILED;
+#ifdef MAP_HUGETLB
+      if(huge_pages) {
+	ret = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(ret != MAP_FAILED) got_hugetlb = true;
+      }
+#endif
+      if(ret == MAP_FAILED) {
+	ret = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ret == MAP_FAILED) {
+	  throw BufferStorageException("MMapStorage couldn't map " + std::to_string(len) +
+				       " bytes: " + strerror(errno));
+	}
+#ifdef MADV_HUGEPAGE
+	if(huge_pages) madvise(ret, len, MADV_HUGEPAGE);
+#endif
+      }
+
+#ifdef SODA_IPC_HAVE_NUMA
+      if(numa_local && (numa_node >= 0) && (numa_available() >= 0)) {
+	numa_tonode_memory(ret, len, numa_node);
+      }
+#else
+      (void) numa_node;
+#endif
+
+      if(lock_pages && (mlock(ret, len) != 0)) {
+	int err = errno;
+	munmap(ret, len);
+	throw BufferStorageException("MMapStorage couldn't lock " + std::to_string(len) +
+				     " bytes: " + strerror(err));
+      }
+      mapped_bytes += len; 
+      return static_cast<char*>(ret);
+    }
+  };
+}
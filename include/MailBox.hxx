@@ -4,6 +4,23 @@
 #include <stdexcept>
 #include <vector>
 #include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "RingQueue.hxx"
+#include "Stats.hxx"
 
 
 /*
@@ -94,6 +111,28 @@ namespace SoDa {
       MailBoxException(name, "::" + operation + " Subscriber ID " + std::to_string(sub_id) + " not found.") {
     }
   }; 
+
+  /**
+   * @brief A lock-free mailbox has a fixed number of subscriber slots, 
+   * and they're all taken. 
+   */
+  class MailBoxTooManySubscribersException : public MailBoxException {
+  public:
+    MailBoxTooManySubscribersException(std::string name, int max_subscribers) :
+      MailBoxException(name, "::subscribe() all " + std::to_string(max_subscribers) + " subscriber slots are in use.") {
+    }
+  }; 
+
+  /**
+   * @brief What a bounded subscriber queue does when a message
+   * arrives and the queue is full.
+   */
+  enum class MailBoxOverflow {
+    BLOCK,       ///< put() waits until the subscriber makes room
+    DROP_NEWEST, ///< the new message is discarded
+    DROP_OLDEST, ///< the oldest waiting message is discarded to make room
+    LATEST_ONLY  ///< only the most recent message is kept (conflation)
+  };
   
   
     /**
@@ -116,15 +155,55 @@ namespace SoDa {
      * Each subscriber gets  message queue.  It is up to the subscriber
      * to "read the mail"
      */
-    MailBox(std::string name) : name(name) {
+    MailBox(std::string name) : name(name), ring_capacity(0), num_rings(0), num_event_fds(0), num_blocked(0) {
+    }
+
+    /**
+     * @brief Create a lock-free mailbox. 
+     *
+     * Each subscriber gets a bounded SoDa::RingQueue instead of a
+     * std::queue.  put() and get() don't take the mailbox mutex (only
+     * subscribe() does), so producers and readers don't stall on each
+     * other, and there are no per-message node allocations.  Each ring
+     * has a lock of its own that put() takes only when that ring's
+     * subscriber is asleep in waitGet() (or, with
+     * MailBoxOverflow::BLOCK, when the ring is full).
+     *
+     * The catch is that the queues are bounded: if a subscriber falls 
+     * more than ring_capacity messages behind, put() drops new messages
+     * for that subscriber until it catches up. (Unless it subscribed
+     * with a different MailBoxOverflow policy.)
+     *
+     * @param name the name of the mailbox
+     * @param ring_capacity each subscriber's queue will hold at least this
+     * many messages.
+     * @param max_subscribers the largest number of subscribers this
+     * mailbox will accept.
+     */
+    MailBox(std::string name, size_t ring_capacity, int max_subscribers = 64) :
+      name(name), ring_capacity(ring_capacity), rings(max_subscribers), num_rings(0), num_event_fds(0), num_blocked(0) {
+      if(ring_capacity == 0) {
+	throw MailBoxException(name, "::MailBox() a lock-free mailbox needs a ring capacity greater than zero.");
+      }
     }
 
     ~MailBox() {
       for(auto & s : message_queues) {
-	while(!s.empty()) s.pop();
+	while(!s.q.empty()) s.q.pop();
+	closeEventFD(s.event_fd, s.signal_fd);
+      }
+      for(auto & r : rings) {
+	if(r) closeEventFD(r->event_fd.load(), r->signal_fd);
       }
       message_queues.clear();
+      rings.clear();
     }
+
+    /**
+     * @brief Was this mailbox created in lock-free mode?
+     * @returns true if subscribers get lock-free ring queues.
+     */
+    bool isLockFree() const { return ring_capacity != 0; }
     
 
     
@@ -133,15 +212,50 @@ namespace SoDa {
      * multiple subscribers to the same mailbox.  A copy of each
      * message will be reserved for each caller. 
      * 
+     * The subscriber's queue is unbounded in a locked mailbox, and
+     * holds ring_capacity messages (dropping the newest when full) in
+     * a lock-free mailbox.
+     *
      * @returns subscriber ID. 
      */
     int subscribe() {
-      std::lock_guard<std::mutex> lock(mtx);	      
+      return subscribe(0, MailBoxOverflow::DROP_NEWEST);
+    }
+
+    /**
+     * @brief Subscribe with a bounded queue, so that a slow
+     * subscriber can't hoard messages (and the buffers they point to)
+     * without limit.
+     *
+     * A subscriber that uses MailBoxOverflow::BLOCK must keep reading
+     * -- if it stops, so does every producer that puts to this mailbox.
+     *
+     * @param capacity the most messages that may wait in the queue.
+     * Zero means unbounded in a locked mailbox, and ring_capacity in a
+     * lock-free mailbox. Lock-free queues round the capacity up to a
+     * power of two.  LATEST_ONLY ignores it.
+     * @param policy what put() does when the queue is full.
+     * @returns subscriber ID. 
+     */
+    int subscribe(size_t capacity, MailBoxOverflow policy) {
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);	      
+      if(isLockFree()) {
+	int ret = num_rings.load(std::memory_order_relaxed);
+	if(ret >= int(rings.size())) {
+	  throw MailBoxTooManySubscribersException(this->name, rings.size());
+	}
+	if(capacity == 0) capacity = ring_capacity; 
+	rings[ret] = std::unique_ptr<Ring>(new Ring(capacity, policy));
+	// publish the new ring to put() and get()
+	num_rings.store(ret + 1, std::memory_order_release);
+	return ret; 
+      }
+      
       // what will the subscriber number be? 
       int ret = message_queues.size();
 
       // make a subscriber queue
-      message_queues.push_back(std::queue<T>());
+      message_queues.push_back(Queue(capacity, policy));
 
       return ret; 
     }
@@ -160,20 +274,147 @@ namespace SoDa {
      * @returns The oldest object in the subscriber's mailbox. 
      */
     T get(int subscriber_id) {
-      std::lock_guard<std::mutex> lock(mtx);	      
-      if(message_queues.size() <= subscriber_id) {
+      if(isLockFree()) {
+	Ring & ring = getRing(subscriber_id, "get()");
+	T ret; 
+	if(ring.queue.pop(ret)) {
+	  ring.received.add();
+	  if(ring.policy == MailBoxOverflow::BLOCK) notifySpace(ring);
+	  return ret;
+	}
+	else return T(0);
+      }
+      
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);	      
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
 	throw MailBoxMissingSubscriberException(this->name, "get()", subscriber_id);
       }
       else {
-	if(message_queues[subscriber_id].empty()) {
+	std::queue<T> & q = message_queues[subscriber_id].q;
+	if(q.empty()) {
 	  return T(0);
 	}
 	else {
-	  T ret = message_queues[subscriber_id].front();
-	  message_queues[subscriber_id].pop();
+	  T ret = q.front();
+	  q.pop();
+	  message_queues[subscriber_id].received.bump();
+	  if(num_blocked > 0) space_cv.notify_all();
+	  return ret;
+	}
+      }
+    }
+
+    /**
+     * @brief Get an object out of the mailbox for this subscriber, 
+     * waiting for one to arrive if the mailbox is empty. 
+     *
+     * The caller sleeps on a condition variable, so an idle subscriber
+     * burns no CPU, and is woken as soon as a message is put. 
+     *
+     * @param subscriber_id the subscriber's ID
+     * @param timeout give up after waiting this long. 
+     * @returns The oldest object in the subscriber's mailbox, or T(0) if
+     * nothing arrived before the timeout.
+     */
+    template<typename Rep, typename Period>
+    T waitGet(int subscriber_id, const std::chrono::duration<Rep, Period> & timeout) {
+      if(isLockFree()) {
+	Ring & ring = getRing(subscriber_id, "waitGet()");
+	T ret;
+	if(ring.queue.pop(ret)) {
+	  ring.received.add();
+	  if(ring.policy == MailBoxOverflow::BLOCK) notifySpace(ring);
+	  return ret;
+	}
+
+	// sleep on this ring's own lock and condition variable, so
+	// producers only pay for the subscribers that are asleep.
+	std::unique_lock<std::mutex> lock(ring.wait_mtx, std::defer_lock);
+	timedLock(lock, ring_wait);
+	// tell the producers that someone needs a poke.  The fence
+	// pairs with the one in notifyWaiters() -- either the producer
+	// sees us waiting, or we see its message in the ring. 
+	ring.num_waiters.fetch_add(1);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	bool got = ring.mail_cv.wait_for(lock, timeout, [&] { return ring.queue.pop(ret); });
+	ring.num_waiters.fetch_sub(1);
+	if(got) {
+	  ring.received.add();
+	  // we hold the ring's lock, so a blocked producer can't slip
+	  // between this notify and its wait.
+	  if(ring.policy == MailBoxOverflow::BLOCK) ring.space_cv.notify_all();
 	  return ret;
 	}
+	else return T(0);
+      }
+      
+      std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+      timedLock(lock, lock_wait);
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
+	throw MailBoxMissingSubscriberException(this->name, "waitGet()", subscriber_id);
+      }
+      // index the queue each time -- subscribe() may move message_queues
+      // while we're asleep.
+      if(!mail_cv.wait_for(lock, timeout, [&] { return !message_queues[subscriber_id].q.empty(); })) {
+	return T(0);
+      }
+      T ret = message_queues[subscriber_id].q.front();
+      message_queues[subscriber_id].q.pop();
+      message_queues[subscriber_id].received.bump();
+      if(num_blocked > 0) space_cv.notify_all();
+      return ret;
+    }
+
+    /**
+     * @brief Take everything that is waiting in the subscriber's mailbox. 
+     *
+     * This takes the mailbox lock once for the whole batch. 
+     *
+     * @param subscriber_id the subscriber's ID
+     * @param out the messages are appended to this vector, oldest first. 
+     * @returns the number of messages appended to out. 
+     */
+    size_t getAll(int subscriber_id, std::vector<T> & out) {
+      return getN(subscriber_id, out, ~size_t(0));
+    }
+
+    /**
+     * @brief Take up to max messages from the subscriber's mailbox. 
+     *
+     * This takes the mailbox lock once for the whole batch. 
+     *
+     * @param subscriber_id the subscriber's ID
+     * @param out the messages are appended to this vector, oldest first. 
+     * @param max take no more than this many messages. 
+     * @returns the number of messages appended to out. 
+     */
+    size_t getN(int subscriber_id, std::vector<T> & out, size_t max) {
+      size_t count = 0; 
+      if(isLockFree()) {
+	Ring & ring = getRing(subscriber_id, "getN()");
+	T m;
+	while((count < max) && ring.queue.pop(m)) {
+	  out.push_back(m);
+	  count++; 
+	}
+	ring.received.add(count);
+	if((count > 0) && (ring.policy == MailBoxOverflow::BLOCK)) notifySpace(ring);
+	return count; 
+      }
+
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
+	throw MailBoxMissingSubscriberException(this->name, "getN()", subscriber_id);
+      }
+      std::queue<T> & q = message_queues[subscriber_id].q;
+      while((count < max) && !q.empty()) {
+	out.push_back(q.front());
+	q.pop();
+	count++; 
       }
+      message_queues[subscriber_id].received.bump(count);
+      if((count > 0) && (num_blocked > 0)) space_cv.notify_all();
+      return count; 
     }
 
     /**
@@ -182,12 +423,66 @@ namespace SoDa {
      * @param msg The message to be sent to every subscriber. Note that this 
      * is passed by value -- each subscriber will get a copy.  Shared pointers
      * work just fine. 
+     *
+     * A subscriber whose queue is full gets (or doesn't get) this
+     * message according to the policy it subscribed with. 
      */
     void put(T msg) {
-      std::lock_guard<std::mutex> lock(mtx);            
-      for(auto & q : message_queues) {
-	q.push(msg);
+      puts.add();
+      if(isLockFree()) {
+	int n = num_rings.load(std::memory_order_acquire);
+	for(int i = 0; i < n; i++) {
+	  deliver(*rings[i], msg); 
+	  if(statsEnabled()) rings[i]->high_water.max(rings[i]->queue.size());
+	}
+	notifyWaiters(n);
+	signalEvents(n);
+	return; 
+      }
+      
+      {
+	std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+	timedLock(lock, lock_wait);
+	for(size_t i = 0; i < message_queues.size(); i++) {
+	  deliver(i, msg, lock);
+	}
+      }
+      mail_cv.notify_all();
+    }
+
+    /**
+     * @brief Place a batch of messages in every subscriber's mailbox
+     *
+     * This takes the mailbox lock (and wakes any waiting subscribers) 
+     * once for the whole batch. 
+     *
+     * @param msgs the messages to send, oldest first. 
+     */
+    void putN(const std::vector<T> & msgs) {
+      puts.add(msgs.size());
+      if(isLockFree()) {
+	int n = num_rings.load(std::memory_order_acquire);
+	for(int i = 0; i < n; i++) {
+	  for(auto & m : msgs) {
+	    deliver(*rings[i], m); 
+	  }
+	  if(statsEnabled()) rings[i]->high_water.max(rings[i]->queue.size());
+	}
+	notifyWaiters(n);
+	signalEvents(n);
+	return; 
+      }
+      
+      {
+	std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+	timedLock(lock, lock_wait);
+	for(size_t i = 0; i < message_queues.size(); i++) {
+	  for(auto & m : msgs) {
+	    deliver(i, m, lock);
+	  }
+	}
       }
+      mail_cv.notify_all();
     }
 
     /**
@@ -196,25 +491,440 @@ namespace SoDa {
      * @param subscriber_id -- the owner. 
      */
     void clear(int subscriber_id) {
-      std::lock_guard<std::mutex> lock(mtx);      
-      if(message_queues.size() <= subscriber_id) {
+      if(isLockFree()) {
+	Ring & ring = getRing(subscriber_id, "clear()");
+	T junk; 
+	while(ring.queue.pop(junk)) { }
+	if(ring.policy == MailBoxOverflow::BLOCK) notifySpace(ring);
+	return; 
+      }
+      
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);      
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
 	throw MailBoxMissingSubscriberException(this->name, "clear()", subscriber_id);	
       }
       else {
-	while(!message_queues[subscriber_id].empty()) {
-	  message_queues[subscriber_id].pop_front();
+	while(!message_queues[subscriber_id].q.empty()) {
+	  message_queues[subscriber_id].q.pop();
 	}
+	if(num_blocked > 0) space_cv.notify_all();
       }
     }
 
+    /**
+     * @brief How many messages has this subscriber lost to its
+     * overflow policy?
+     *
+     * @param subscriber_id the subscriber's ID
+     * @returns the number of messages dropped (new or old) since the
+     * subscriber subscribed.
+     */
+    uint64_t dropped(int subscriber_id) {
+      if(isLockFree()) {
+	return getRing(subscriber_id, "dropped()").dropped.load(std::memory_order_relaxed);
+      }
+      
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);      
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
+	throw MailBoxMissingSubscriberException(this->name, "dropped()", subscriber_id);	
+      }
+      return message_queues[subscriber_id].dropped;
+    }
+
+    /**
+     * @brief How far behind is this subscriber?
+     *
+     * @param subscriber_id the subscriber's ID
+     * @returns the number of messages waiting in the subscriber's
+     * queue. (In lock-free mode this is a snapshot -- it may be stale
+     * by the time you look at it.)
+     */
+    size_t lag(int subscriber_id) {
+      if(isLockFree()) {
+	return getRing(subscriber_id, "lag()").queue.size();
+      }
+      
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);      
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
+	throw MailBoxMissingSubscriberException(this->name, "lag()", subscriber_id);	
+      }
+      return message_queues[subscriber_id].q.size();
+    }
+
+    /**
+     * @brief Get a file descriptor that polls readable when mail
+     * arrives for this subscriber, for use with poll/epoll/select (or
+     * SoDa::Selector) alongside sockets and timers.
+     *
+     * The descriptor is owned by the mailbox -- don't close it, and
+     * don't read it yourself.  On Linux it is an eventfd; elsewhere
+     * it is the read end of a pipe.  It is signaled when the
+     * subscriber's queue goes from "looked empty" to having mail, so
+     * when it polls readable, get() messages until ready() returns
+     * false.  ready() re-arms the descriptor.
+     *
+     * A subscriber that never asks for a descriptor costs put()
+     * nothing.
+     *
+     * @param subscriber_id the subscriber's ID
+     * @returns the descriptor.  The same one is returned on every call.
+     */
+    int getEventFD(int subscriber_id) {
+      if(isLockFree()) {
+	Ring & ring = getRing(subscriber_id, "getEventFD()");
+	TimedLockGuard<std::mutex> lock(mtx, lock_wait);
+	if(ring.event_fd.load(std::memory_order_relaxed) < 0) {
+	  // start out signaled, in case there's mail waiting already
+	  ring.armed.store(true);
+	  int fd = makeEventFD(ring.signal_fd);
+	  ring.event_fd.store(fd, std::memory_order_release);
+	  num_event_fds.fetch_add(1, std::memory_order_release);
+	}
+	return ring.event_fd.load(std::memory_order_relaxed);
+      }
+
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);      
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
+	throw MailBoxMissingSubscriberException(this->name, "getEventFD()", subscriber_id);	
+      }
+      Queue & sub = message_queues[subscriber_id];
+      if(sub.event_fd < 0) {
+	sub.armed = true;
+	sub.event_fd = makeEventFD(sub.signal_fd);
+      }
+      return sub.event_fd;
+    }
+
+    /**
+     * @brief Is there mail waiting for this subscriber?
+     *
+     * If not, and the subscriber has an event descriptor, the
+     * descriptor is cleared and re-armed so the next put() will
+     * signal it.
+     *
+     * @param subscriber_id the subscriber's ID
+     * @returns true if get() would (very probably) return a message.
+     */
+    bool ready(int subscriber_id) {
+      if(isLockFree()) {
+	Ring & ring = getRing(subscriber_id, "ready()");
+	if(!ring.queue.empty()) return true;
+	if(!ring.armed.load()) return false;
+	clearEventFD(ring.event_fd.load(std::memory_order_acquire));
+	ring.armed.store(false);
+	// pairs with the fence in put() -- either the producer sees
+	// armed is clear and signals, or we see its message here.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return !ring.queue.empty();
+      }
+
+      TimedLockGuard<std::mutex> lock(mtx, lock_wait);      
+      if((subscriber_id < 0) || (size_t(subscriber_id) >= message_queues.size())) {
+	throw MailBoxMissingSubscriberException(this->name, "ready()", subscriber_id);	
+      }
+      Queue & sub = message_queues[subscriber_id];
+      if(!sub.q.empty()) return true;
+      if(sub.armed) {
+	clearEventFD(sub.event_fd);
+	sub.armed = false;
+      }
+      return false;
+    }
+
+    /**
+     * @brief One subscriber's part of a Stats snapshot.
+     */
+    struct SubscriberStats {
+      size_t depth;        ///< messages waiting now -- see lag()
+      uint64_t dropped;    ///< see dropped()
+      uint64_t received;   ///< messages the subscriber has taken
+      uint64_t high_water; ///< the deepest the queue has been
+    };
+
+    /**
+     * @brief A snapshot of the mailbox's counters. See snapshot().
+     *
+     * puts, received, high_water, lock_wait and ring_wait are zero (or empty)
+     * unless the mailbox was compiled with SODA_IPC_STATS.
+     */
+    struct Stats {
+      bool enabled;       ///< were the counters compiled in?
+      uint64_t puts;      ///< messages put (each counted once, however many subscribers)
+      std::vector<SubscriberStats> subscribers; ///< indexed by subscriber ID
+      /// waits for the mailbox lock -- see SoDa::LockWaitHistogram
+      std::vector<uint64_t> lock_wait;
+      /// in lock-free mode, waits for a subscriber's own wait lock, taken
+      /// when it sleeps in waitGet() and by producers that wake it or
+      /// block on its full queue.
+      std::vector<uint64_t> ring_wait;
+    };
+
+    /**
+     * @brief Collect the mailbox's counters.
+     *
+     * @returns a copy of the counters as of (roughly) now.
+     */
+    Stats snapshot() {
+      Stats st;
+      st.enabled = statsEnabled();
+      st.puts = puts.get();
+      st.lock_wait = lock_wait.get();
+      st.ring_wait = ring_wait.get();
+      std::lock_guard<std::mutex> lock(mtx);
+      if(isLockFree()) {
+	int n = num_rings.load(std::memory_order_acquire);
+	for(int i = 0; i < n; i++) {
+	  Ring & ring = *rings[i];
+	  SubscriberStats ss = { ring.queue.size(), ring.dropped.load(std::memory_order_relaxed),
+				 ring.received.get(), ring.high_water.get() };
+	  st.subscribers.push_back(ss);
+	}
+      }
+      else {
+	for(auto & sub : message_queues) {
+	  SubscriberStats ss = { sub.q.size(), sub.dropped, sub.received.get(), sub.high_water.get() };
+	  st.subscribers.push_back(ss);
+	}
+      }
+      return st;
+    }
+
 
   protected:
     std::string name;
-    std::vector<std::queue<T>> message_queues; 
+
+    // locked mode subscriber. capacity 0 means unbounded.
+    struct Queue {
+      Queue(size_t capacity, MailBoxOverflow policy) :
+	capacity(capacity), policy(policy), dropped(0), event_fd(-1), signal_fd(-1), armed(false) { }
+      std::queue<T> q;
+      size_t capacity;
+      MailBoxOverflow policy;
+      uint64_t dropped; 
+      int event_fd;
+      int signal_fd; // where put() writes -- the same as event_fd, except for a pipe
+      bool armed; // event_fd has been signaled and not yet cleared
+      StatCounter received, high_water; 
+    };
+    
+    std::vector<Queue> message_queues; 
+
+    // lock-free mode subscriber
+    struct Ring {
+      Ring(size_t capacity, MailBoxOverflow policy) :
+	queue(capacity), policy(policy), dropped(0), event_fd(-1), signal_fd(-1), armed(false),
+	num_waiters(0), num_blocked(0) { }
+      RingQueue<T> queue; 
+      MailBoxOverflow policy;
+      std::atomic<uint64_t> dropped;
+      std::atomic<int> event_fd;
+      int signal_fd; // set before event_fd is published
+      std::atomic<bool> armed;
+      StatCounter received, high_water; 
+      // subscribers asleep in waitGet() and producers blocked on a
+      // full BLOCK-ing ring wait here, not on the mailbox lock.
+      std::mutex wait_mtx;
+      std::condition_variable mail_cv, space_cv;
+      std::atomic<int> num_waiters, num_blocked;
+    };
+    
+    // lock-free mode stuff. rings is sized at construction and never
+    // resized, so put() and get() can index it without the mutex. 
+    size_t ring_capacity; 
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::atomic<int> num_rings; 
+    // how many rings have an event descriptor? put() skips the
+    // signaling pass when there are none.
+    std::atomic<int> num_event_fds; 
+
+    // Put a message in a locked-mode queue.  The caller holds the
+    // lock.  A BLOCK-ing put releases it while it waits, and
+    // subscribe() may move message_queues meanwhile, so the queue is
+    // found by index.
+    void deliver(size_t idx, const T & msg, std::unique_lock<std::mutex> & lock) {
+      Queue & sub = message_queues[idx];
+      switch(sub.policy) {
+      case MailBoxOverflow::LATEST_ONLY:
+	sub.dropped += sub.q.size();
+	while(!sub.q.empty()) sub.q.pop();
+	break; 
+      case MailBoxOverflow::DROP_NEWEST:
+	if((sub.capacity != 0) && (sub.q.size() >= sub.capacity)) {
+	  sub.dropped++;
+	  return; 
+	}
+	break; 
+      case MailBoxOverflow::DROP_OLDEST:
+	if((sub.capacity != 0) && (sub.q.size() >= sub.capacity)) {
+	  sub.q.pop();
+	  sub.dropped++;
+	}
+	break; 
+      case MailBoxOverflow::BLOCK:
+	if((sub.capacity != 0) && (sub.q.size() >= sub.capacity)) {
+	  // the full subscriber may be waiting on messages we've already put.
+	  mail_cv.notify_all();
+	  num_blocked++;
+	  space_cv.wait(lock, [&] { return message_queues[idx].q.size() < message_queues[idx].capacity; });
+	  num_blocked--;
+	}
+	break; 
+      }
+      Queue & dest = message_queues[idx];
+      dest.q.push(msg);
+      dest.high_water.max(dest.q.size());
+      if((dest.event_fd >= 0) && !dest.armed) {
+	dest.armed = true;
+	signalEventFD(dest.signal_fd);
+      }
+    }
+
+    // Put a message in a lock-free ring, without the lock (unless
+    // this is a BLOCK-ing subscriber and it is full). 
+    void deliver(Ring & ring, const T & msg) {
+      T junk;
+      if(ring.policy == MailBoxOverflow::LATEST_ONLY) {
+	while(ring.queue.pop(junk)) ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      if(ring.queue.push(msg)) return; 
+      
+      switch(ring.policy) {
+      case MailBoxOverflow::DROP_NEWEST:
+	ring.dropped.fetch_add(1, std::memory_order_relaxed);
+	break; 
+      case MailBoxOverflow::LATEST_ONLY:
+      case MailBoxOverflow::DROP_OLDEST:
+	// another producer may be filling the space we make, so keep at it.
+	while(!ring.queue.push(msg)) {
+	  if(ring.queue.pop(junk)) ring.dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	break; 
+      case MailBoxOverflow::BLOCK:
+	{
+	  // the full subscriber may be asleep, waiting for messages we've already put.
+	  std::atomic_thread_fence(std::memory_order_seq_cst);
+	  wakeRing(ring);
+	  std::unique_lock<std::mutex> lock(ring.wait_mtx, std::defer_lock);
+	  timedLock(lock, ring_wait);
+	  // the fence pairs with the one in notifySpace()
+	  ring.num_blocked.fetch_add(1);
+	  std::atomic_thread_fence(std::memory_order_seq_cst);
+	  ring.space_cv.wait(lock, [&] { return ring.queue.push(msg); });
+	  ring.num_blocked.fetch_sub(1);
+	}
+	break; 
+      }
+    }
+
+    Ring & getRing(int subscriber_id, const char * operation) {
+      if((subscriber_id < 0) || (subscriber_id >= num_rings.load(std::memory_order_acquire))) {
+	throw MailBoxMissingSubscriberException(this->name, operation, subscriber_id);
+      }
+      return *rings[subscriber_id];
+    }
+
+    // In lock-free mode, put() only takes a ring's lock when that
+    // ring's subscriber is asleep in waitGet().  The fence is what
+    // that costs: a waiter bumps num_waiters and then looks at the
+    // ring, and we push and then look at num_waiters, so one of us
+    // has to see the other.  It is one fence per put(), however many
+    // subscribers there are.
+    void notifyWaiters(int n) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      for(int i = 0; i < n; i++) wakeRing(*rings[i]);
+    }
+
+    // the caller must have fenced after pushing.
+    void wakeRing(Ring & ring) {
+      if(ring.num_waiters.load(std::memory_order_relaxed) > 0) {
+	TimedLockGuard<std::mutex> lock(ring.wait_mtx, ring_wait);
+	ring.mail_cv.notify_all();
+      }
+    }
     
 
-    // mutual exclusion stuff
+    // Signal the event descriptors of the first n rings, unless they've
+    // been signaled already.  The caller must have fenced after
+    // pushing its messages (notifyWaiters() does).
+    void signalEvents(int n) {
+      if(num_event_fds.load(std::memory_order_acquire) == 0) return; 
+      for(int i = 0; i < n; i++) {
+	Ring & ring = *rings[i];
+	if(ring.armed.load(std::memory_order_relaxed)) continue; 
+	int fd = ring.event_fd.load(std::memory_order_acquire);
+	if((fd >= 0) && !ring.armed.exchange(true)) signalEventFD(ring.signal_fd);
+      }
+    }
+
+    // Make a descriptor that starts out readable.  Returns the end to
+    // poll, and sets signal_fd to the end to write. 
+    int makeEventFD(int & signal_fd) {
+#ifdef __linux__
+      int fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+      if(fd < 0) {
+	throw MailBoxException(this->name, std::string("::getEventFD() eventfd failed: ") + strerror(errno));
+      }
+      signal_fd = fd;
+      return fd; 
+#else
+      int fds[2];
+      if(pipe(fds) != 0) {
+	throw MailBoxException(this->name, std::string("::getEventFD() pipe failed: ") + strerror(errno));
+      }
+      for(int fd : fds) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      signal_fd = fds[1];
+      signalEventFD(signal_fd);
+      return fds[0];
+#endif
+    }
+
+    static void closeEventFD(int fd, int signal_fd) {
+      if(fd < 0) return;
+      close(fd);
+      if(signal_fd != fd) close(signal_fd);
+    }
+
+    // The armed flag means there is never more than one signal
+    // outstanding, so a pipe never fills up.
+    static void signalEventFD(int fd) {
+      uint64_t one = 1;
+      // the only failure is a saturated counter, which is still readable.
+      ssize_t r = write(fd, &one, sizeof(one));
+      (void) r;
+    }
+
+    static void clearEventFD(int fd) {
+      uint64_t junk;
+      ssize_t r = read(fd, &junk, sizeof(junk));
+      (void) r;
+    }
+
+    // In lock-free mode, get() only takes the ring's lock when a
+    // producer is stuck on this (full, BLOCK-ing) ring.
+    void notifySpace(Ring & ring) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(ring.num_blocked.load(std::memory_order_relaxed) > 0) {
+	TimedLockGuard<std::mutex> lock(ring.wait_mtx, ring_wait);
+	ring.space_cv.notify_all();
+      }
+    }
+
+    // mutual exclusion stuff.  In lock-free mode, only subscribe()
+    // and the odd bookkeeping call take mtx -- the waiting is done on
+    // each ring's own lock.
     std::mutex mtx; 
+    std::condition_variable mail_cv; 
+    // producers waiting for room in a BLOCK-ing subscriber's queue (locked mode)
+    std::condition_variable space_cv; 
+    std::atomic<int> num_blocked; 
+
+    // statistics
+    StatCounter puts; 
+    LockWaitHistogram lock_wait; 
+    LockWaitHistogram ring_wait; 
     
   };
 
@@ -0,0 +1,221 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file RingQueue.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+namespace SoDa {
+
+  /**
+   * @brief Who may use a SoDa::RingQueue at the same time?
+   */
+  enum class RingMode {
+    MPMC, ///< any number of producers and consumers
+    MPSC, ///< any number of producers, one consumer at a time
+    SPSC  ///< one producer and one consumer at a time
+  };
+
+  /**
+   * @class RingQueue
+   * @brief A bounded, lock-free queue.
+   *
+   * This is the per-subscriber queue used by a lock-free SoDa::MailBox.
+   * Each slot in the ring carries a sequence number that tells a producer
+   * whether the slot is free and a consumer whether it is full, so
+   * neither side ever takes a lock.
+   *
+   * When a side may have several threads (a multi-producer push or a
+   * multi-consumer pop), claiming a slot takes a compare-and-swap on
+   * the head (or tail) index.  A side with only one thread doesn't
+   * need one: it is an acquire load of the slot's sequence number, a
+   * relaxed store of the index, and a release store of the sequence
+   * number.  Pick the weakest mode that fits -- it is the caller's job
+   * to make sure that, say, only one thread pops an MPSC ring.
+   *
+   * SoDa::MailBox uses MPMC rings.  Any number of threads may put(),
+   * and the DROP_OLDEST and LATEST_ONLY overflow policies have the
+   * producers pop from a full ring as well as the subscriber.
+   *
+   * The head and tail indices are padded out to their own cache lines
+   * so that a producer bumping the head doesn't invalidate the line
+   * that a consumer is spinning on.
+   *
+   * @tparam T the type of the queued element. It must be default
+   * constructible.  Popped slots are reset to T() so that
+   * shared pointers don't linger in the ring after they've been read.
+   * @tparam mode how many threads may push and pop at once.
+   */
+  template<typename T, RingMode mode = RingMode::MPMC>
+  class RingQueue {
+  public:
+    /**
+     * @brief Create a ring.
+     *
+     * @param capacity the ring will hold at least this many
+     * elements. The actual capacity is rounded up to the next power of
+     * two.
+     */
+    RingQueue(size_t capacity) {
+      size_t cap = 2;
+      while(cap < capacity) cap = cap << 1;
+      mask = cap - 1;
+      cells = std::unique_ptr<Cell[]>(new Cell[cap]);
+      for(size_t i = 0; i < cap; i++) {
+	cells[i].seq.store(i, std::memory_order_relaxed);
+      }
+      enqueue_pos.store(0, std::memory_order_relaxed);
+      dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Add an element to the tail of the ring.
+     *
+     * @param v the element to add
+     * @returns true if the element was added, false if the ring was full.
+     */
+    bool push(const T & v) {
+      size_t pos;
+      Cell * cell = claim(enqueue_pos, 0, mode != RingMode::SPSC, pos);
+      // a slot that hasn't been read yet means we're full.
+      if(cell == nullptr) return false;
+      cell->data = v;
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * @brief Take the element at the head of the ring.
+     *
+     * @param v the popped element is moved to here.
+     * @returns true if an element was popped, false if the ring was empty.
+     */
+    bool pop(T & v) {
+      size_t pos;
+      Cell * cell = claim(dequeue_pos, 1, mode == RingMode::MPMC, pos);
+      // nothing has been written here yet.
+      if(cell == nullptr) return false;
+      v = std::move(cell->data);
+      cell->data = T();
+      cell->seq.store(pos + mask + 1, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * @brief How many elements are in the ring?
+     *
+     * This is only a snapshot -- other threads may be pushing
+     * and popping while we look.
+     *
+     * @returns the approximate number of elements waiting in the ring.
+     */
+    size_t size() const {
+      size_t tail = dequeue_pos.load(std::memory_order_relaxed);
+      size_t head = enqueue_pos.load(std::memory_order_relaxed);
+      return (head > tail) ? (head - tail) : 0;
+    }
+
+    /**
+     * @brief Is the ring empty?
+     * @returns true if there was nothing in the ring when we looked.
+     */
+    bool empty() const { return size() == 0; }
+
+    /**
+     * @brief How many elements will the ring hold?
+     * @returns the (power of two) capacity of the ring.
+     */
+    size_t capacity() const { return mask + 1; }
+
+  protected:
+    struct Cell {
+      std::atomic<size_t> seq;
+      T data;
+    };
+
+    /**
+     * Claim the next cell on one side of the ring.  A cell is ready
+     * for a push when its sequence number equals the position, and
+     * for a pop when it equals the position + 1.
+     *
+     * @param index enqueue_pos or dequeue_pos
+     * @param ready 0 for a push, 1 for a pop
+     * @param shared might other threads be moving index too?
+     * @param pos set to the claimed position
+     * @returns the claimed cell, or nullptr if it isn't ready (the
+     * ring is full or empty).
+     */
+    Cell * claim(std::atomic<size_t> & index, size_t ready, bool shared, size_t & pos) {
+      pos = index.load(std::memory_order_relaxed);
+      if(!shared) {
+	Cell * cell = &cells[pos & mask];
+	if(cell->seq.load(std::memory_order_acquire) != pos + ready) return nullptr;
+	index.store(pos + 1, std::memory_order_relaxed);
+	return cell;
+      }
+      while(1) {
+	Cell * cell = &cells[pos & mask];
+	size_t seq = cell->seq.load(std::memory_order_acquire);
+	intptr_t dif = (intptr_t) seq - (intptr_t) (pos + ready);
+	if(dif == 0) {
+	  if(index.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return cell;
+	}
+	else if(dif < 0) {
+	  return nullptr;
+	}
+	else {
+	  pos = index.load(std::memory_order_relaxed);
+	}
+      }
+    }
+
+    static const size_t CACHE_LINE = 64;
+
+    // read-mostly stuff goes on the first line
+    char pad0[CACHE_LINE];
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+
+    // producers pound on this
+    char pad1[CACHE_LINE];
+    std::atomic<size_t> enqueue_pos;
+
+    // and consumers pound on this.
+    char pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeue_pos;
+    char pad3[CACHE_LINE - sizeof(std::atomic<size_t>)];
+  };
+}
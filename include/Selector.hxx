@@ -0,0 +1,163 @@
+#pragma once
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+
+#include "MailBox.hxx"
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file Selector.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+namespace SoDa {
+
+  /**
+   * @brief poll() failed for some reason other than a signal.
+   */
+  class SelectorException : public std::runtime_error {
+  public:
+    SelectorException(const std::string & problem) :
+      std::runtime_error("SoDa::Selector " + problem) {
+    }
+  };
+
+  /**
+   * @class Selector
+   * @brief Wait for mail on any of several subscriptions, in any
+   * number of mailboxes.
+   *
+   * A thread that listens to (say) a command mailbox, an RX sample
+   * mailbox and a TX sample mailbox adds each subscription to a
+   * selector, then calls wait() instead of spinning over get() on
+   * each one.  wait() sleeps in poll() on the subscriptions' event
+   * descriptors (see MailBox::getEventFD()) and returns the
+   * subscription that has mail.
+   *
+   * When several subscriptions have mail, wait() takes them in turn,
+   * so a busy mailbox can't starve the others.
+   *
+   * A selector belongs to one thread.  Code that already has an epoll
+   * loop can skip the selector and add MailBox::getEventFD()
+   * descriptors to the loop directly.
+   */
+  class Selector {
+  public:
+    Selector() : next(0) { }
+
+    /**
+     * @brief Add a subscription to the set this selector waits on.
+     *
+     * @param mailbox the mailbox.  It must outlive the selector.
+     * @param subscriber_id the subscription, from mailbox.subscribe()
+     * @returns the index that wait() will return when this
+     * subscription has mail. Indices count up from 0 in the order
+     * subscriptions are added.
+     */
+    template<typename T>
+    int add(MailBox<T> & mailbox, int subscriber_id) {
+      struct pollfd pfd;
+      pfd.fd = mailbox.getEventFD(subscriber_id);
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      pollfds.push_back(pfd);
+      MailBox<T> * mb = &mailbox;
+      ready_funcs.push_back([mb, subscriber_id]() { return mb->ready(subscriber_id); });
+      return ready_funcs.size() - 1;
+    }
+
+    /**
+     * @brief Wait for mail on any subscription.
+     *
+     * @param timeout give up after this long.
+     * @returns the index (from add()) of a subscription with mail
+     * waiting, or -1 if the timeout expired first.
+     */
+    template<typename Rep, typename Period>
+    int wait(const std::chrono::duration<Rep, Period> & timeout) {
+      auto deadline = std::chrono::steady_clock::now() +
+	std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+      while(1) {
+	// checking ready() re-arms the descriptors of the empty
+	// subscriptions, so poll() won't return until something new
+	// arrives.
+	int r = poll();
+	if(r >= 0) return r;
+
+	auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+	if(remaining.count() < 0) return -1;
+	// round up, so we don't spin through the last fraction of a millisecond.
+	int ms = remaining.count() + 1;
+	if(::poll(pollfds.data(), pollfds.size(), ms) < 0) {
+	  if(errno != EINTR) {
+	    throw SelectorException(std::string("poll failed: ") + strerror(errno));
+	  }
+	}
+      }
+    }
+
+    /**
+     * @brief Check the subscriptions without waiting.
+     *
+     * @returns the index of a subscription with mail waiting, or -1
+     * if they are all empty.
+     */
+    int poll() {
+      size_t n = ready_funcs.size();
+      for(size_t k = 0; k < n; k++) {
+	size_t i = (next + k) % n;
+	if(ready_funcs[i]()) {
+	  next = i + 1;
+	  return i;
+	}
+      }
+      return -1;
+    }
+
+    /**
+     * @brief How many subscriptions does this selector watch?
+     */
+    size_t size() const { return ready_funcs.size(); }
+
+  private:
+    std::vector<struct pollfd> pollfds;
+    std::vector<std::function<bool()>> ready_funcs;
+    size_t next; ///< where the next scan starts, for fairness
+  };
+}
@@ -0,0 +1,762 @@
+#pragma once
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <memory>
+#include <atomic>
+#include <type_traits>
+#include <thread>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ShmSegment.hxx"
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file SharedBufferPool.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+/**
+ * @page SoDa::SharedBufferPool Buffers that can be passed between processes
+ *
+ * SoDa::BufferPool and SoDa::MailBox are strictly inter-thread.  A
+ * SoDa::SharedBufferPool puts a fixed number of fixed-size buffers in
+ * a shared memory segment (see SoDa::ShmSegment), along with the
+ * subscriber queues for a SoDa::SharedMailBox.  A producer in one
+ * process can fill a buffer and put it in the mailbox, and
+ * subscribers in other processes read the very same storage. Nothing
+ * is copied; only a 32-bit block index goes through the queue.
+ *
+ * ## Reference counts across processes
+ *
+ * Each block has a total reference count, plus a count for each
+ * process (each "participant") attached to the segment. A message
+ * sitting in a subscriber's queue holds one count on the total. When
+ * the total drops to zero, the block goes back on a lock-free free
+ * list in the segment.
+ *
+ * If a process dies while holding buffers (or while subscribed),
+ * any surviving process can call reap(). That finds participants
+ * whose process is gone, drops their per-process counts from the
+ * totals, drains their subscriber queues, and frees their slots.  A
+ * process that dies in the middle of a reference count update might
+ * leak that one block -- it is never freed twice.
+ *
+ * ## Restrictions
+ *
+ *  - T must be trivially copyable -- the elements are shared raw memory.
+ *  - The number and size of the buffers are fixed when the segment
+ *    is created.  getHandle() returns an empty handle when they're all
+ *    in use.
+ *  - Handles must not outlive the SharedBufferPool object in the
+ *    process that holds them.
+ *  - A child fork()ed after the parent attached inherits the parent's
+ *    pool object, but not its place in the pool.  Handles the child
+ *    inherits still read the buffers, and copying or dropping them
+ *    leaves the parent's counts alone, but getHandle() and the
+ *    SharedMailBox calls throw -- the child should attach again.
+ *  - A participant is recognized as dead by its pid and, on Linux,
+ *    the start time of its process, so a pid that has been reused
+ *    doesn't keep a dead participant alive.  Elsewhere reap() has only
+ *    the pid to go on, and misses a participant whose pid was reused.
+ *  - The creator of a named segment removes the name when it lets
+ *    go of the pool.  A creator that dies without doing that leaves
+ *    the name behind, and creating the pool again fails until
+ *    someone calls SharedBufferPool::remove() (or deletes it from
+ *    /dev/shm).
+ */
+
+namespace SoDa {
+
+  template <typename T> class SharedBufferPool;
+  template <typename T> class SharedMailBox;
+
+  /**
+   * @brief Catch this if you don't care why a SharedBufferPool or
+   * SharedMailBox complained.
+   */
+  class SharedBufferPoolException : public std::runtime_error {
+  public:
+    SharedBufferPoolException(const std::string & name, const std::string & problem) :
+      std::runtime_error("SoDa::SharedBufferPool[" + name + "] " + problem) {
+    }
+  };
+
+  /**
+   * @class SharedBufferHandle
+   * @brief A reference counted handle to a buffer in a SoDa::SharedBufferPool.
+   *
+   * This works like SoDa::BufferHandle: copy it around, and the
+   * buffer goes back to the (shared) pool when the last handle in the
+   * last process lets go.
+   */
+  template <typename T>
+  class SharedBufferHandle {
+  public:
+    SharedBufferHandle() : pool(nullptr), idx(NONE) { }
+    SharedBufferHandle(std::nullptr_t) : pool(nullptr), idx(NONE) { }
+
+    SharedBufferHandle(const SharedBufferHandle & other) : pool(other.pool), idx(other.idx) {
+      if(idx != NONE) pool->addRef(idx);
+    }
+
+    SharedBufferHandle(SharedBufferHandle && other) noexcept : pool(other.pool), idx(other.idx) {
+      other.idx = NONE;
+    }
+
+    SharedBufferHandle & operator=(const SharedBufferHandle & other) {
+      if(other.idx != NONE) other.pool->addRef(other.idx);
+      release();
+      pool = other.pool;
+      idx = other.idx;
+      return *this;
+    }
+
+    SharedBufferHandle & operator=(SharedBufferHandle && other) noexcept {
+      if(this != &other) {
+	release();
+	pool = other.pool;
+	idx = other.idx;
+	other.idx = NONE;
+      }
+      return *this;
+    }
+
+    ~SharedBufferHandle() { release(); }
+
+    void reset() {
+      release();
+      idx = NONE;
+    }
+
+    T * data() const { return pool->blockData(idx); }
+    size_t size() const { return pool->blockLength(idx); }
+    T & operator[](size_t i) const { return data()[i]; }
+    T * begin() const { return data(); }
+    T * end() const { return data() + size(); }
+
+    /**
+     * @brief Which block in the segment is this?  The same block has
+     * the same index in every process.
+     */
+    uint32_t index() const { return idx; }
+
+    explicit operator bool() const { return idx != NONE; }
+    bool operator==(const SharedBufferHandle & other) const { return (idx == other.idx) && ((idx == NONE) || (pool == other.pool)); }
+    bool operator!=(const SharedBufferHandle & other) const { return !(*this == other); }
+    bool operator==(std::nullptr_t) const { return idx == NONE; }
+    bool operator!=(std::nullptr_t) const { return idx != NONE; }
+
+  private:
+    friend class SharedBufferPool<T>;
+    friend class SharedMailBox<T>;
+    static const uint32_t NONE = 0xffffffff;
+
+    // adopt a reference that has already been counted.
+    static SharedBufferHandle adopt(SharedBufferPool<T> * pool, uint32_t idx) {
+      SharedBufferHandle ret;
+      ret.pool = pool;
+      ret.idx = idx;
+      return ret;
+    }
+
+    void release() {
+      if(idx != NONE) pool->releaseRef(idx);
+    }
+
+    SharedBufferPool<T> * pool;
+    uint32_t idx;
+  };
+
+  /**
+   * @class SharedBufferPool
+   * @brief A pool of fixed size buffers in a shared memory segment,
+   * along with the queues for a SoDa::SharedMailBox.
+   *
+   * @tparam T the element type. It must be trivially copyable.
+   */
+  template <typename T>
+  class SharedBufferPool {
+  public:
+    static_assert(std::is_trivially_copyable<T>::value,
+		  "SharedBufferPool elements must be trivially copyable.");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+		  "SharedBufferPool needs lock-free 64 bit atomics.");
+
+    /**
+     * @brief Create a segment and the pool in it.
+     *
+     * @param name the segment's shm_open name (e.g. "/rx_samples"),
+     * or "" for an anonymous segment that other processes reach
+     * through getFD().
+     * @param buffer_len the number of elements in each buffer
+     * @param num_buffers the number of buffers in the pool
+     * @param max_participants the most processes that can attach at once
+     * @param max_subscribers the most SharedMailBox subscribers there can be
+     * @param queue_capacity each subscriber's queue holds this many
+     * messages (rounded up to a power of two).
+     */
+    SharedBufferPool(const std::string & name, size_t buffer_len, uint32_t num_buffers,
+		     uint32_t max_participants = 16, uint32_t max_subscribers = 16,
+		     uint32_t queue_capacity = 64) : name(name) {
+      if((num_buffers == 0) || (num_buffers >= 0xffffffff) || (max_participants == 0)) {
+	throw SharedBufferPoolException(name, "needs at least one buffer and one participant.");
+      }
+      if(max_participants > MAX_PARTICIPANTS) {
+	throw SharedBufferPoolException(name, "can't have more than " + std::to_string(MAX_PARTICIPANTS) +
+					" participants.");
+      }
+      uint32_t qcap = 2;
+      while(qcap < queue_capacity) qcap = qcap << 1;
+
+      Header proto;
+      proto.block_len = buffer_len;
+      proto.num_blocks = num_buffers;
+      proto.max_participants = max_participants;
+      proto.max_subscribers = max_subscribers;
+      proto.queue_capacity = qcap;
+      proto.block_header_bytes = roundUp(2 * sizeof(std::atomic<uint32_t>) + 2 * sizeof(uint32_t) +
+					 max_participants * sizeof(std::atomic<uint32_t>), 64);
+      proto.block_stride = roundUp(proto.block_header_bytes + buffer_len * sizeof(T), 64);
+      proto.subscriber_stride = roundUp(sizeof(Subscriber) + qcap * sizeof(Cell), 64);
+      proto.participants_offset = roundUp(sizeof(Header), 64);
+      proto.subscribers_offset = proto.participants_offset + roundUp(max_participants * sizeof(Participant), 64);
+      proto.blocks_offset = proto.subscribers_offset + max_subscribers * proto.subscriber_stride;
+      proto.total_bytes = proto.blocks_offset + num_buffers * proto.block_stride;
+
+      segment = std::unique_ptr<ShmSegment>(ShmSegment::create(name, proto.total_bytes));
+      base = segment->getBase();
+      hdr = reinterpret_cast<Header*>(base);
+
+      // the segment arrives zero filled, so only the non-zero stuff needs setting.
+      hdr->elem_size = sizeof(T);
+      hdr->version = VERSION;
+      hdr->block_len = proto.block_len;
+      hdr->num_blocks = proto.num_blocks;
+      hdr->max_participants = proto.max_participants;
+      hdr->max_subscribers = proto.max_subscribers;
+      hdr->queue_capacity = proto.queue_capacity;
+      hdr->block_header_bytes = proto.block_header_bytes;
+      hdr->block_stride = proto.block_stride;
+      hdr->subscriber_stride = proto.subscriber_stride;
+      hdr->participants_offset = proto.participants_offset;
+      hdr->subscribers_offset = proto.subscribers_offset;
+      hdr->blocks_offset = proto.blocks_offset;
+      hdr->total_bytes = proto.total_bytes;
+
+      for(uint32_t s = 0; s < max_subscribers; s++) {
+	Subscriber * sub = subscriber(s);
+	Cell * cells = subscriberCells(sub);
+	for(uint32_t c = 0; c < qcap; c++) {
+	  cells[c].seq.store(c, std::memory_order_relaxed);
+	}
+      }
+
+      // thread the free list through the blocks, lowest index on top.
+      for(uint32_t b = 0; b < num_buffers; b++) {
+	blockHeader(b)->next_free.store((b + 1 < num_buffers) ? (b + 1) : NONE, std::memory_order_relaxed);
+      }
+      hdr->free_head.store(0, std::memory_order_relaxed);
+      hdr->num_free.store(num_buffers, std::memory_order_relaxed);
+
+      me = join();
+      hdr->magic = MAGIC;
+      hdr->ready.store(1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Attach to a pool that another process created.
+     *
+     * @param name the name that the creator used.
+     */
+    SharedBufferPool(const std::string & name) : name(name) {
+      segment = std::unique_ptr<ShmSegment>(ShmSegment::attach(name));
+      attachSegment();
+    }
+
+    /**
+     * @brief Attach to an anonymous pool through its file descriptor.
+     *
+     * @param fd the creator's getFD(), inherited or passed to this process.
+     */
+    SharedBufferPool(int fd) : name("fd:" + std::to_string(fd)) {
+      segment = std::unique_ptr<ShmSegment>(ShmSegment::attach(fd));
+      attachSegment();
+    }
+
+    /**
+     * @brief Detach from the segment.  Any references this process
+     * still holds, and any subscriptions it made, are released just as
+     * if the process had died.
+     */
+    ~SharedBufferPool() {
+      // a forked child's copy doesn't speak for the parent.
+      if(forked()) return;
+      cleanupParticipant(me);
+      leave(me);
+    }
+
+    /**
+     * @brief Get a buffer from the shared pool.
+     *
+     * @param n the number of elements wanted -- no more than the
+     * buffer length the pool was created with.
+     * @returns a handle to the buffer, or an empty handle if every
+     * buffer is in use.
+     */
+    SharedBufferHandle<T> getHandle(size_t n) {
+      checkFork("getHandle");
+      if(n > hdr->block_len) {
+	throw SharedBufferPoolException(name, "getHandle() asked for " + std::to_string(n) +
+					" elements, but buffers only hold " + std::to_string(hdr->block_len));
+      }
+      uint32_t idx = popFree();
+      if(idx == NONE) return SharedBufferHandle<T>();
+      BlockHeader * bh = blockHeader(idx);
+      bh->length = n;
+      bh->total_refs.store(1, std::memory_order_relaxed);
+      blockRefs(bh)[me].store(1, std::memory_order_relaxed);
+      return SharedBufferHandle<T>::adopt(this, idx);
+    }
+
+    /**
+     * @brief Find participants whose processes have died, and give
+     * back everything they held.
+     *
+     * @returns the number of dead participants cleaned up.
+     */
+    int reap() {
+      int count = 0;
+      for(uint32_t p = 0; p < hdr->max_participants; p++) {
+	int32_t pid = participant(p)->pid.load(std::memory_order_acquire);
+	if(pid <= 0) continue;
+	if(processAlive(pid, participant(p)->start_time.load(std::memory_order_acquire))) continue;
+	// claim the cleanup, so only one reaper does it.
+	if(!participant(p)->pid.compare_exchange_strong(pid, -1)) continue;
+	cleanupParticipant(p);
+	leave(p);
+	count++;
+      }
+      return count;
+    }
+
+    /**
+     * @brief How many buffers are free right now?
+     */
+    uint32_t numFree() const { return hdr->num_free.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief How many buffers are there in all?
+     */
+    uint32_t numBuffers() const { return hdr->num_blocks; }
+
+    /**
+     * @brief How many elements does each buffer hold?
+     */
+    size_t bufferLength() const { return hdr->block_len; }
+
+    /**
+     * @brief The descriptor that other processes can attach with.
+     */
+    int getFD() const { return segment->getFD(); }
+
+    const std::string & getName() const { return name; }
+
+    /**
+     * @brief Remove the name of a segment whose creator died without
+     * removing it, so that the pool can be created again.  Processes
+     * still attached to the old segment keep it.
+     *
+     * @param name the name the creator used
+     * @returns true if there was such a segment.
+     */
+    static bool remove(const std::string & name) { return ShmSegment::remove(name); }
+
+  private:
+    friend class SharedBufferHandle<T>;
+    friend class SharedMailBox<T>;
+
+    static const uint64_t MAGIC = 0x536f446149504321ULL; // "SoDaIPC!"
+    static const uint32_t VERSION = 2;
+    static const uint32_t NONE = 0xffffffff;
+    static const uint32_t MAX_PARTICIPANTS = 0xffffff;
+
+    // A subscriber slot's state word holds the slot's generation in
+    // the top 32 bits, the participant that owns it in bits 8-31, and
+    // a SubscriberState in the low byte.  A slot being set up by
+    // subscribe() is SUB_CLAIMED, so that a slot whose claimer dies
+    // halfway can be reaped.  Closing a slot moves it on to the next
+    // generation, and every queued message is tagged with the
+    // generation it was sent to -- so a close (or a put that raced
+    // it) drains only its own generation's messages, and never eats
+    // those of a subscriber that has since reused the slot.
+    enum SubscriberState { SUB_FREE = 0, SUB_LIVE = 1, SUB_CLAIMED = 2 };
+
+    static uint64_t subState(uint32_t gen, uint32_t p, SubscriberState st) {
+      return (uint64_t(gen) << 32) | (uint64_t(p) << 8) | uint64_t(st);
+    }
+    static SubscriberState stateOf(uint64_t word) { return SubscriberState(word & 0xff); }
+    static uint32_t ownerOf(uint64_t word) { return uint32_t(word >> 8) & MAX_PARTICIPANTS; }
+    static uint32_t generationOf(uint64_t word) { return uint32_t(word >> 32); }
+    // is generation a no later than b?  (They wrap.)
+    static bool notAfter(uint32_t a, uint32_t b) { return int32_t(a - b) <= 0; }
+
+    // Everything in the segment refers to everything else by offset.
+    struct Header {
+      uint64_t magic;
+      uint32_t version;
+      uint32_t elem_size;
+      uint64_t block_len;
+      uint32_t num_blocks;
+      uint32_t max_participants;
+      uint32_t max_subscribers;
+      uint32_t queue_capacity;
+      uint64_t block_header_bytes;
+      uint64_t block_stride;
+      uint64_t subscriber_stride;
+      uint64_t participants_offset;
+      uint64_t subscribers_offset;
+      uint64_t blocks_offset;
+      uint64_t total_bytes;
+      std::atomic<uint64_t> free_head; // ABA tag in the top half, block index in the bottom
+      std::atomic<uint32_t> num_free;
+      std::atomic<uint32_t> ready;
+    };
+
+    struct Participant {
+      std::atomic<int32_t> pid; // 0 is free, -1 is being cleaned up
+      uint32_t pad0;
+      std::atomic<uint64_t> start_time; // 0 if we don't know
+      char pad[48];
+    };
+
+    // followed by max_participants per-process counts, then the elements.
+    struct BlockHeader {
+      std::atomic<uint32_t> total_refs;
+      std::atomic<uint32_t> next_free;
+      uint32_t length;
+      uint32_t pad;
+    };
+
+    struct Subscriber {
+      std::atomic<uint64_t> state;
+      std::atomic<uint64_t> dropped;
+      char pad0[48];
+      std::atomic<uint64_t> enqueue_pos;
+      char pad1[56];
+      std::atomic<uint64_t> dequeue_pos;
+      char pad2[56];
+    };
+
+    struct Cell {
+      std::atomic<uint64_t> seq;
+      uint32_t block;
+      // read before the cell is claimed, so it has to be atomic
+      std::atomic<uint32_t> generation;
+    };
+
+    std::string name;
+    std::unique_ptr<ShmSegment> segment;
+    char * base;
+    Header * hdr;
+    uint32_t me;
+    int32_t my_pid; // the process that joined as participant me
+
+    static uint64_t roundUp(uint64_t v, uint64_t granule) {
+      return ((v + granule - 1) / granule) * granule;
+    }
+
+    void attachSegment() {
+      base = segment->getBase();
+      hdr = reinterpret_cast<Header*>(base);
+      // give the creator a moment to finish setting things up.
+      for(int i = 0; (i < 1000) && (hdr->ready.load(std::memory_order_acquire) == 0); i++) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      if((hdr->ready.load(std::memory_order_acquire) == 0) || (hdr->magic != MAGIC) ||
+	 (hdr->version != VERSION)) {
+	throw SharedBufferPoolException(name, "segment isn't a SharedBufferPool (or isn't finished yet).");
+      }
+      if((hdr->elem_size != sizeof(T)) || (hdr->total_bytes > segment->getSize())) {
+	throw SharedBufferPoolException(name, "segment was created for a different element type.");
+      }
+      me = join();
+    }
+
+    uint32_t join() {
+      my_pid = currentPID();
+      uint64_t start = processStartTime(my_pid);
+      for(uint32_t p = 0; p < hdr->max_participants; p++) {
+	int32_t expected = 0;
+	if(participant(p)->pid.compare_exchange_strong(expected, my_pid)) {
+	  participant(p)->start_time.store(start, std::memory_order_release);
+	  return p;
+	}
+      }
+      // perhaps someone died and left a slot behind
+      if(reap() > 0) return join();
+      throw SharedBufferPoolException(name, "all " + std::to_string(hdr->max_participants) +
+				      " participant slots are in use.");
+    }
+
+    void leave(uint32_t p) {
+      participant(p)->start_time.store(0, std::memory_order_relaxed);
+      participant(p)->pid.store(0, std::memory_order_release);
+    }
+
+    // A start time of 0 means we don't know it (yet), so the pid has
+    // to do.
+    static bool processAlive(int32_t pid, uint64_t start_time) {
+      if((kill(pid, 0) != 0) && (errno == ESRCH)) return false;
+      if(start_time == 0) return true;
+      uint64_t now = processStartTime(pid);
+      return (now == 0) || (now == start_time);
+    }
+
+    // When did process pid start, in clock ticks since boot?  0 if we
+    // can't tell.
+    static uint64_t processStartTime(int32_t pid) {
+#ifdef __linux__
+      std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+      std::string line;
+      if(!std::getline(stat, line)) return 0;
+      // The command name (field 2) is in parentheses and may contain
+      // anything, so count from the last ')'.  starttime is field 22.
+      size_t rparen = line.rfind(')');
+      if(rparen == std::string::npos) return 0;
+      std::istringstream ss(line.substr(rparen + 1));
+      std::string field;
+      for(int f = 3; f < 22; f++) {
+	if(!(ss >> field)) return 0;
+      }
+      uint64_t start = 0;
+      if(!(ss >> start)) return 0;
+      return start;
+#else
+      (void) pid;
+      return 0;
+#endif
+    }
+
+    // getpid() is a system call, so keep a copy, and refresh it in
+    // the child after a fork().
+    static std::atomic<int32_t> & cachedPID() {
+      static std::atomic<int32_t> pid(static_cast<int32_t>(getpid()));
+      return pid;
+    }
+
+    static void refreshPID() { cachedPID().store(int32_t(getpid()), std::memory_order_relaxed); }
+
+    static int32_t currentPID() {
+      static const bool tracked = (pthread_atfork(nullptr, nullptr, refreshPID) == 0);
+      return tracked ? cachedPID().load(std::memory_order_relaxed) : int32_t(getpid());
+    }
+
+    // are we a child forked after this object attached?
+    bool forked() const { return currentPID() != my_pid; }
+
+    void checkFork(const std::string & fn) const {
+      if(forked()) {
+	throw SharedBufferPoolException(name, fn + "() called in a process forked after the pool was attached."
+					" Attach to the pool again in the child.");
+      }
+    }
+
+    Participant * participant(uint32_t p) {
+      return reinterpret_cast<Participant*>(base + hdr->participants_offset) + p;
+    }
+
+    BlockHeader * blockHeader(uint32_t idx) {
+      return reinterpret_cast<BlockHeader*>(base + hdr->blocks_offset + idx * hdr->block_stride);
+    }
+
+    std::atomic<uint32_t> * blockRefs(BlockHeader * bh) {
+      return reinterpret_cast<std::atomic<uint32_t>*>(reinterpret_cast<char*>(bh) + sizeof(BlockHeader));
+    }
+
+    T * blockData(uint32_t idx) {
+      return reinterpret_cast<T*>(reinterpret_cast<char*>(blockHeader(idx)) + hdr->block_header_bytes);
+    }
+
+    size_t blockLength(uint32_t idx) { return blockHeader(idx)->length; }
+
+    Subscriber * subscriber(uint32_t s) {
+      return reinterpret_cast<Subscriber*>(base + hdr->subscribers_offset + s * hdr->subscriber_stride);
+    }
+
+    Cell * subscriberCells(Subscriber * sub) {
+      return reinterpret_cast<Cell*>(reinterpret_cast<char*>(sub) + sizeof(Subscriber));
+    }
+
+    // The counts are updated total-first on the way up and
+    // per-process-first on the way down.  A process that dies between
+    // the two steps leaves the total too high, so the block leaks
+    // rather than being freed while someone still has it.  A forked
+    // child's handles share the parent's counts, so it leaves them be.
+    void addRef(uint32_t idx) {
+      if(forked()) return;
+      BlockHeader * bh = blockHeader(idx);
+      bh->total_refs.fetch_add(1, std::memory_order_relaxed);
+      blockRefs(bh)[me].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void releaseRef(uint32_t idx) {
+      if(forked()) return;
+      BlockHeader * bh = blockHeader(idx);
+      blockRefs(bh)[me].fetch_sub(1, std::memory_order_relaxed);
+      dropTotal(idx, 1);
+    }
+
+    void dropTotal(uint32_t idx, uint32_t count) {
+      if(blockHeader(idx)->total_refs.fetch_sub(count, std::memory_order_acq_rel) == count) {
+	pushFree(idx);
+      }
+    }
+
+    uint32_t popFree() {
+      uint64_t head = hdr->free_head.load(std::memory_order_acquire);
+      while(1) {
+	uint32_t idx = uint32_t(head);
+	if(idx == NONE) return NONE;
+	uint32_t next = blockHeader(idx)->next_free.load(std::memory_order_relaxed);
+	uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+	if(hdr->free_head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel)) {
+	  hdr->num_free.fetch_sub(1, std::memory_order_relaxed);
+	  return idx;
+	}
+      }
+    }
+
+    void pushFree(uint32_t idx) {
+      uint64_t head = hdr->free_head.load(std::memory_order_relaxed);
+      while(1) {
+	blockHeader(idx)->next_free.store(uint32_t(head), std::memory_order_relaxed);
+	uint64_t new_head = ((head >> 32) + 1) << 32 | idx;
+	if(hdr->free_head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel)) {
+	  hdr->num_free.fetch_add(1, std::memory_order_relaxed);
+	  return;
+	}
+      }
+    }
+
+    // The subscriber queues are the same sequence-numbered ring as
+    // SoDa::RingQueue, but with the cells in the segment.
+    bool pushQueue(Subscriber * sub, uint32_t idx, uint32_t gen) {
+      Cell * cells = subscriberCells(sub);
+      uint64_t mask = hdr->queue_capacity - 1;
+      uint64_t pos = sub->enqueue_pos.load(std::memory_order_relaxed);
+      Cell * cell;
+      while(1) {
+	cell = &cells[pos & mask];
+	uint64_t seq = cell->seq.load(std::memory_order_acquire);
+	int64_t dif = (int64_t) seq - (int64_t) pos;
+	if(dif == 0) {
+	  if(sub->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+	}
+	else if(dif < 0) return false;
+	else pos = sub->enqueue_pos.load(std::memory_order_relaxed);
+      }
+      cell->block = idx;
+      cell->generation.store(gen, std::memory_order_relaxed);
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Pop the next message, unless it was sent to a generation later
+    // than max_gen.  gen gets the generation it was sent to.
+    uint32_t popQueue(Subscriber * sub, uint32_t max_gen, uint32_t & gen) {
+      Cell * cells = subscriberCells(sub);
+      uint64_t mask = hdr->queue_capacity - 1;
+      uint64_t pos = sub->dequeue_pos.load(std::memory_order_relaxed);
+      Cell * cell;
+      while(1) {
+	cell = &cells[pos & mask];
+	uint64_t seq = cell->seq.load(std::memory_order_acquire);
+	int64_t dif = (int64_t) seq - (int64_t) (pos + 1);
+	if(dif == 0) {
+	  gen = cell->generation.load(std::memory_order_relaxed);
+	  if(!notAfter(gen, max_gen)) return NONE;
+	  if(sub->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+	}
+	else if(dif < 0) return NONE;
+	else pos = sub->dequeue_pos.load(std::memory_order_relaxed);
+      }
+      uint32_t ret = cell->block;
+      cell->seq.store(pos + mask + 1, std::memory_order_release);
+      return ret;
+    }
+
+    // drop the messages in a subscriber's queue that were sent to
+    // generation max_gen or earlier.
+    void drainQueue(Subscriber * sub, uint32_t max_gen) {
+      uint32_t idx, gen;
+      while((idx = popQueue(sub, max_gen, gen)) != NONE) dropTotal(idx, 1);
+    }
+
+    // Close a subscription that is in state word st: free the slot
+    // for the next generation, then drop what's queued for this one.
+    // The fence pairs with the one in SharedMailBox::put() -- either
+    // the drain sees a racing put's message, or the put sees the slot
+    // has moved on and drains it itself.
+    void closeSubscriber(Subscriber * sub, uint64_t st) {
+      uint32_t gen = generationOf(st);
+      if(!sub->state.compare_exchange_strong(st, subState(gen + 1, 0, SUB_FREE), std::memory_order_seq_cst)) return;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      drainQueue(sub, gen);
+    }
+
+    // give back everything participant p holds, and close its
+    // subscriptions -- including any it was in the middle of making.
+    void cleanupParticipant(uint32_t p) {
+      for(uint32_t s = 0; s < hdr->max_subscribers; s++) {
+	Subscriber * sub = subscriber(s);
+	uint64_t st = sub->state.load(std::memory_order_acquire);
+	if((stateOf(st) != SUB_FREE) && (ownerOf(st) == p)) {
+	  closeSubscriber(sub, st);
+	}
+      }
+      for(uint32_t b = 0; b < hdr->num_blocks; b++) {
+	BlockHeader * bh = blockHeader(b);
+	uint32_t held = blockRefs(bh)[p].exchange(0, std::memory_order_acq_rel);
+	if(held > 0) dropTotal(b, held);
+      }
+    }
+  };
+}
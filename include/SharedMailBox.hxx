@@ -0,0 +1,193 @@
+#pragma once
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+
+#include "SharedBufferPool.hxx"
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file SharedMailBox.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+namespace SoDa {
+
+  /**
+   * @class SharedMailBox
+   * @brief A SoDa::MailBox for buffers in a SoDa::SharedBufferPool,
+   * with subscribers in any process attached to the pool.
+   *
+   * The subscriber queues live in the pool's segment, so there is one
+   * mailbox per pool.  Every process makes its own SharedMailBox
+   * object on its own SharedBufferPool; they all see the same
+   * subscribers.
+   *
+   * put() and get() never block.  Each subscriber's queue holds a
+   * fixed number of messages (set when the pool is created). When a
+   * subscriber's queue is full, put() drops the message for that
+   * subscriber and counts the drop.
+   */
+  template <typename T>
+  class SharedMailBox {
+  public:
+    /**
+     * @param pool the (created or attached) pool whose buffers this
+     * mailbox carries.
+     */
+    SharedMailBox(SharedBufferPool<T> & pool) : pool(pool) { }
+
+    /**
+     * @brief Subscribe the calling process.  The subscription lasts
+     * until unsubscribe(), or until this process detaches from the
+     * pool (or dies and is reaped).
+     *
+     * @returns the subscriber ID, for use in get()
+     */
+    int subscribe() {
+      pool.checkFork("subscribe");
+      for(uint32_t s = 0; s < pool.hdr->max_subscribers; s++) {
+	auto sub = pool.subscriber(s);
+	uint64_t st = sub->state.load(std::memory_order_acquire);
+	if(Pool::stateOf(st) != Pool::SUB_FREE) continue;
+	uint32_t gen = Pool::generationOf(st);
+	if(sub->state.compare_exchange_strong(st, Pool::subState(gen, pool.me, Pool::SUB_CLAIMED))) {
+	  sub->dropped.store(0, std::memory_order_relaxed);
+	  // anything left behind belongs to nobody.
+	  pool.drainQueue(sub, gen - 1);
+	  sub->state.store(Pool::subState(gen, pool.me, Pool::SUB_LIVE), std::memory_order_release);
+	  return s;
+	}
+      }
+      throw SharedBufferPoolException(pool.getName(), "all " + std::to_string(pool.hdr->max_subscribers) +
+				      " mailbox subscriber slots are in use.");
+    }
+
+    /**
+     * @brief Cancel a subscription and drop whatever is waiting for it.
+     *
+     * @param id a subscriber ID returned by subscribe() in this process.
+     */
+    void unsubscribe(int id) {
+      pool.checkFork("unsubscribe");
+      auto sub = checkID(id, "unsubscribe");
+      uint64_t st = sub->state.load(std::memory_order_acquire);
+      if(Pool::stateOf(st) == Pool::SUB_LIVE) pool.closeSubscriber(sub, st);
+    }
+
+    /**
+     * @brief Send a buffer to every subscriber.  The sender may keep
+     * its handle, but shouldn't write to the buffer after this.
+     *
+     * @param msg a handle from the same pool
+     */
+    void put(const SharedBufferHandle<T> & msg) {
+      if(!msg) return;
+      pool.checkFork("put");
+      uint32_t idx = msg.index();
+      for(uint32_t s = 0; s < pool.hdr->max_subscribers; s++) {
+	auto sub = pool.subscriber(s);
+	uint64_t st = sub->state.load(std::memory_order_acquire);
+	if(Pool::stateOf(st) != Pool::SUB_LIVE) continue;
+	uint32_t gen = Pool::generationOf(st);
+	// the queued message holds its own count
+	pool.blockHeader(idx)->total_refs.fetch_add(1, std::memory_order_relaxed);
+	if(!pool.pushQueue(sub, idx, gen)) {
+	  pool.dropTotal(idx, 1);
+	  sub->dropped.fetch_add(1, std::memory_order_relaxed);
+	  continue;
+	}
+	// If the subscriber went away while we were pushing, its drain
+	// may have missed our message -- so drain again ourselves, or
+	// the queue would hold the buffer forever.  Only this
+	// generation's messages: the slot may already have a new owner.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(sub->state.load(std::memory_order_seq_cst) != st) {
+	  pool.drainQueue(sub, gen);
+	}
+      }
+    }
+
+    /**
+     * @brief Get the next message for this subscriber.
+     *
+     * @param id a subscriber ID returned by subscribe() in this process.
+     * @returns a handle to the buffer, or an empty handle if nothing
+     * is waiting (or the subscription is gone).
+     */
+    SharedBufferHandle<T> get(int id) {
+      pool.checkFork("get");
+      auto sub = checkID(id, "get");
+      uint64_t st = sub->state.load(std::memory_order_acquire);
+      if(Pool::stateOf(st) != Pool::SUB_LIVE) return SharedBufferHandle<T>();
+      uint32_t gen = Pool::generationOf(st);
+      while(1) {
+	uint32_t sent_to;
+	uint32_t idx = pool.popQueue(sub, gen, sent_to);
+	if(idx == Pool::NONE) return SharedBufferHandle<T>();
+	if(sent_to == gen) {
+	  // the count that the queue held now belongs to this process
+	  pool.blockRefs(pool.blockHeader(idx))[pool.me].fetch_add(1, std::memory_order_relaxed);
+	  return SharedBufferHandle<T>::adopt(&pool, idx);
+	}
+	// a late put to the slot's previous subscriber
+	pool.dropTotal(idx, 1);
+      }
+    }
+
+    /**
+     * @brief How many messages has this subscriber missed because its
+     * queue was full?
+     */
+    uint64_t dropped(int id) {
+      return checkID(id, "dropped")->dropped.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Clean up after subscribers (and buffer holders) whose
+     * processes have died.  See SharedBufferPool::reap().
+     */
+    int reap() { return pool.reap(); }
+
+  private:
+    typedef SharedBufferPool<T> Pool;
+
+    typename Pool::Subscriber * checkID(int id, const std::string & fn) {
+      if((id < 0) || (uint32_t(id) >= pool.hdr->max_subscribers)) {
+	throw SharedBufferPoolException(pool.getName(), fn + "() got bad subscriber ID " + std::to_string(id));
+      }
+      return pool.subscriber(id);
+    }
+
+    SharedBufferPool<T> & pool;
+  };
+}
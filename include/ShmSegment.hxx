@@ -0,0 +1,228 @@
+#pragma once
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file ShmSegment.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+namespace SoDa {
+
+  /**
+   * @brief Something went wrong creating or mapping a shared memory segment.
+   */
+  class ShmSegmentException : public std::runtime_error {
+  public:
+    ShmSegmentException(const std::string & name, const std::string & problem) :
+      std::runtime_error("SoDa::ShmSegment[" + name + "] " + problem) {
+    }
+  };
+
+  /**
+   * @class ShmSegment
+   * @brief A chunk of memory mapped into several processes.
+   *
+   * A segment either has a name (it lives in /dev/shm via shm_open,
+   * and any process that knows the name can attach to it) or is
+   * anonymous (other processes get at it by inheriting or being
+   * passed the file descriptor).  On Linux an anonymous segment is a
+   * memfd.  Elsewhere it is made with shm_open under a random name
+   * that is unlinked right away, so only the descriptor remains.
+   *
+   * The segment will generally be mapped at a different address in
+   * each process, so anything that lives in it must refer to other
+   * things in it by offset, not by pointer.
+   */
+  class ShmSegment {
+  public:
+    /**
+     * @brief Create a new segment.
+     *
+     * @param name the shm_open name ("/something"), or an empty string
+     * for an anonymous segment.
+     * @param bytes the size of the segment.  It is zero filled.
+     */
+    static ShmSegment * create(const std::string & name, size_t bytes) {
+      int fd;
+      if(name.empty()) {
+	fd = createAnonymous();
+      }
+      else {
+	fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+      }
+      if(fd < 0) {
+	throw ShmSegmentException(name, std::string("create failed: ") + strerror(errno));
+      }
+      if(ftruncate(fd, bytes) != 0) {
+	int err = errno;
+	close(fd);
+	if(!name.empty()) shm_unlink(name.c_str());
+	throw ShmSegmentException(name, std::string("couldn't size the segment: ") + strerror(err));
+      }
+      return new ShmSegment(name, fd, bytes, true);
+    }
+
+    /**
+     * @brief Attach to a named segment that somebody else created.
+     *
+     * @param name the name passed to create()
+     */
+    static ShmSegment * attach(const std::string & name) {
+      int fd = shm_open(name.c_str(), O_RDWR, 0600);
+      if(fd < 0) {
+	throw ShmSegmentException(name, std::string("attach failed: ") + strerror(errno));
+      }
+      return new ShmSegment(name, fd, segmentSize(name, fd), false);
+    }
+
+    /**
+     * @brief Attach to a segment through a file descriptor -- one
+     * inherited across fork(), or passed over a unix socket.
+     *
+     * @param fd the descriptor.  The segment makes its own copy.
+     */
+    static ShmSegment * attach(int fd) {
+      int myfd = dup(fd);
+      if(myfd < 0) {
+	throw ShmSegmentException("fd", std::string("dup failed: ") + strerror(errno));
+      }
+      return new ShmSegment("", myfd, segmentSize("fd", myfd), false);
+    }
+
+    ~ShmSegment() {
+      munmap(base, bytes);
+      close(fd);
+      if(owner && !name.empty() && (getpid() == owner_pid)) shm_unlink(name.c_str());
+    }
+
+    /**
+     * @brief Where is the segment mapped in this process?
+     */
+    char * getBase() const { return base; }
+
+    /**
+     * @brief How big is it?
+     */
+    size_t getSize() const { return bytes; }
+
+    /**
+     * @brief The descriptor that other processes can attach() with.
+     */
+    int getFD() const { return fd; }
+
+    /**
+     * @brief Did this process create the segment?  The creator
+     * removes the name when it lets go of the segment; processes that
+     * are still attached keep their mappings.  (A child forked from
+     * the creator inherits the object but not the job.)
+     */
+    bool isOwner() const { return owner; }
+
+    /**
+     * @brief Remove a name that a creator left behind -- one that
+     * died without running its destructor, say.  Processes that are
+     * still attached keep their mappings.
+     *
+     * @param name the name passed to create()
+     * @returns true if there was such a name.
+     */
+    static bool remove(const std::string & name) {
+      return shm_unlink(name.c_str()) == 0;
+    }
+
+    const std::string & getName() const { return name; }
+
+  private:
+    ShmSegment(const std::string & name, int fd, size_t bytes, bool owner) :
+      name(name), fd(fd), bytes(bytes), owner(owner), owner_pid(getpid()) {
+      void * p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(p == MAP_FAILED) {
+	int err = errno;
+	close(fd);
+	if(owner && !name.empty()) shm_unlink(name.c_str());
+	throw ShmSegmentException(name, std::string("mmap failed: ") + strerror(err));
+      }
+      base = static_cast<char*>(p);
+    }
+
+    static int createAnonymous() {
+#ifdef __linux__
+      return memfd_create("SoDaIPC", MFD_CLOEXEC);
+#else
+      // No memfd: make a name nobody else will pick, and unlink it
+      // as soon as we have the descriptor.  (Keep it short -- some
+      // systems allow only 31 characters.)
+      static unsigned int counter = 0;
+      unsigned long stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+      for(int tries = 0; tries < 100; tries++) {
+	std::string tmp = "/SoDaIPC." + std::to_string(getpid()) + "." +
+	  std::to_string((stamp + counter++) % 1000000);
+	int fd = shm_open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd >= 0) {
+	  shm_unlink(tmp.c_str());
+	  fcntl(fd, F_SETFD, FD_CLOEXEC);
+	  return fd;
+	}
+	if(errno != EEXIST) break;
+      }
+      return -1;
+#endif
+    }
+
+    static size_t segmentSize(const std::string & name, int fd) {
+      struct stat st;
+      if(fstat(fd, &st) != 0) {
+	int err = errno;
+	close(fd);
+	throw ShmSegmentException(name, std::string("fstat failed: ") + strerror(err));
+      }
+      return st.st_size;
+    }
+
+    std::string name;
+    int fd;
+    size_t bytes;
+    bool owner;
+    pid_t owner_pid; 
+    char * base;
+  };
+}
@@ -0,0 +1,195 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file Stats.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+/**
+ * @page SoDa::Stats Counting what the pools and mailboxes are doing
+ *
+ * SoDa::BufferPool and SoDa::MailBox count gets, refills, drops and
+ * so on, and time how long threads wait for their locks -- but only
+ * when the code that includes them is compiled with SODA_IPC_STATS
+ * defined (the ENABLE_STATS cmake option does that for this
+ * project).  Otherwise the counters and histograms are empty classes
+ * whose methods do nothing, and the compiler throws them away.
+ *
+ * Either way, the classes' snapshot() methods are there; the
+ * snapshot's enabled flag says whether the numbers mean anything.
+ *
+ * Every translation unit in a program must agree on SODA_IPC_STATS.
+ */
+
+namespace SoDa {
+
+  /**
+   * @brief Are the statistics compiled in?
+   */
+  inline constexpr bool statsEnabled() {
+#ifdef SODA_IPC_STATS
+    return true;
+#else
+    return false;
+#endif
+  }
+
+#ifdef SODA_IPC_STATS
+  /**
+   * @class StatCounter
+   * @brief A counter that can be read from any thread.
+   *
+   * bump() is for counters with a single writer -- one thread, or
+   * whoever holds the lock that protects the thing being counted --
+   * and costs a plain load and store. add() works with any number
+   * of writers.
+   */
+  class StatCounter {
+  public:
+    StatCounter() : v(0) { }
+    StatCounter(const StatCounter & other) : v(other.get()) { }
+    StatCounter & operator=(const StatCounter & other) {
+      v.store(other.get(), std::memory_order_relaxed);
+      return *this;
+    }
+
+    void bump(uint64_t n = 1) {
+      v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void add(uint64_t n = 1) { v.fetch_add(n, std::memory_order_relaxed); }
+    /// keep the largest value seen
+    void max(uint64_t n) {
+      uint64_t cur = v.load(std::memory_order_relaxed);
+      while((n > cur) && !v.compare_exchange_weak(cur, n, std::memory_order_relaxed)) { }
+    }
+    void reset() { v.store(0, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<uint64_t> v;
+  };
+
+  /**
+   * @class LockWaitHistogram
+   * @brief How long did threads wait for a lock?
+   *
+   * Bucket 0 counts acquisitions that didn't wait at all.  Bucket i
+   * counts waits of 2^(i-1) up to 2^i nanoseconds.  The last bucket
+   * collects everything longer.
+   */
+  class LockWaitHistogram {
+  public:
+    static const int NUM_BUCKETS = 32;
+
+    LockWaitHistogram() {
+      for(auto & b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t ns) {
+      int i = 0;
+      while((ns != 0) && (i < NUM_BUCKETS - 1)) {
+	ns = ns >> 1;
+	i++;
+      }
+      buckets[i].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<uint64_t> get() const {
+      std::vector<uint64_t> ret(NUM_BUCKETS);
+      for(int i = 0; i < NUM_BUCKETS; i++) ret[i] = buckets[i].load(std::memory_order_relaxed);
+      return ret;
+    }
+
+  private:
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+  };
+
+  /**
+   * @brief Lock a mutex (or a unique_lock), recording how long we
+   * waited for it.
+   */
+  template<typename Lockable>
+  void timedLock(Lockable & m, LockWaitHistogram & hist) {
+    if(m.try_lock()) {
+      hist.record(0);
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    m.lock();
+    auto waited = std::chrono::steady_clock::now() - start;
+    // a wait always lands in bucket 1 or above
+    hist.record(1 + std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count());
+  }
+#else
+  class StatCounter {
+  public:
+    void bump(uint64_t /* n */ = 1) { }
+    void add(uint64_t /* n */ = 1) { }
+    void max(uint64_t /* n */) { }
+    void reset() { }
+    uint64_t get() const { return 0; }
+  };
+
+  class LockWaitHistogram {
+  public:
+    static const int NUM_BUCKETS = 32;
+    void record(uint64_t /* ns */) { }
+    std::vector<uint64_t> get() const { return std::vector<uint64_t>(); }
+  };
+
+  template<typename Lockable>
+  void timedLock(Lockable & m, LockWaitHistogram & /* hist */) {
+    m.lock();
+  }
+#endif
+
+  /**
+   * @class TimedLockGuard
+   * @brief A std::lock_guard that records its wait in a LockWaitHistogram.
+   */
+  template<typename Mutex>
+  class TimedLockGuard {
+  public:
+    TimedLockGuard(Mutex & m, LockWaitHistogram & hist) : m(m) {
+      timedLock(m, hist);
+    }
+    ~TimedLockGuard() { m.unlock(); }
+    TimedLockGuard(const TimedLockGuard &) = delete;
+    TimedLockGuard & operator=(const TimedLockGuard &) = delete;
+  private:
+    Mutex & m;
+  };
+}
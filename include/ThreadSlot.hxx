@@ -0,0 +1,138 @@
+#pragma once
+#include <vector>
+#include <mutex>
+
+/*
+BSD 2-Clause License
+
+Copyright (c) 2022, Matt Reilly - kb1vc
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file ThreadSlot.hxx
+ * @author Matt Reilly (kb1vc)
+ * @date Oct 16, 2026
+ */
+
+namespace SoDa {
+
+  /**
+   * @class ThreadSlot
+   * @brief Hand each thread a small integer that no other live thread
+   * is using.
+   *
+   * SoDa::BufferPool uses the slot number to index its per-thread
+   * buffer caches.  That way a pool can keep a plain array of caches
+   * rather than a thread_local map of pools, and the caches die with
+   * the pool, not with the thread.
+   *
+   * When a thread exits, its slot number goes back on a free list and
+   * will be handed to the next thread that asks.  That thread inherits
+   * whatever the old thread left in the caches -- which is just fine,
+   * as nobody else could have been touching them.
+   */
+  class ThreadSlot {
+  public:
+    /**
+     * @brief There are only this many slots. Threads beyond this
+     * number get no slot at all.
+     */
+    static const int MAX_SLOTS = 256;
+
+    /**
+     * @brief Which slot belongs to the calling thread?
+     *
+     * @returns the slot number (0 to MAX_SLOTS-1), or -1 if all the
+     * slots are taken or the thread is on its way out.
+     */
+    static int get() {
+      // a plain int is still safe to read while the thread is
+      // running its thread_local destructors.
+      static thread_local int id = UNASSIGNED;
+      if(id == UNASSIGNED) {
+	id = take();
+	static thread_local Releaser releaser(id);
+      }
+      return id;
+    }
+
+    /**
+     * @brief Call fn(slot) for each slot that was used by a thread
+     * that has since exited.  No thread can be handed a slot until
+     * this returns, so fn may touch per-slot state that would
+     * otherwise belong to the slot's owner.
+     */
+    template<typename F>
+    static void forEachIdle(F fn) {
+      std::lock_guard<std::mutex> lock(slotMutex());
+      for(int id : freeSlots()) fn(id);
+    }
+
+  private:
+    static const int UNASSIGNED = -2;
+
+    class Releaser {
+    public:
+      Releaser(int & id) : id_p(&id) { }
+      ~Releaser() {
+	give(*id_p);
+	*id_p = -1;
+      }
+    private:
+      int * id_p;
+    };
+
+    static std::mutex & slotMutex() {
+      static std::mutex mtx;
+      return mtx;
+    }
+
+    static std::vector<int> & freeSlots() {
+      static std::vector<int> free_slots;
+      return free_slots;
+    }
+
+    static int take() {
+      static int next_slot = 0;
+      std::lock_guard<std::mutex> lock(slotMutex());
+      std::vector<int> & free_slots = freeSlots();
+      if(!free_slots.empty()) {
+	int ret = free_slots.back();
+	free_slots.pop_back();
+	return ret;
+      }
+      if(next_slot < MAX_SLOTS) {
+	return next_slot++;
+      }
+      return -1;
+    }
+
+    static void give(int id) {
+      if(id < 0) return;
+      std::lock_guard<std::mutex> lock(slotMutex());
+      freeSlots().push_back(id);
+    }
+  };
+}
@@ -1,8 +1,25 @@
 #include "../include/Buffer.hxx"
 #include "../include/BufferPool.hxx"
 #include <type_traits>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 #include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+// count heap allocations, so we can tell if the handle path really is allocation free
+static std::atomic<long> alloc_count(0);
+void * operator new(size_t sz) {
+  alloc_count++;
+  void * ret = std::malloc(sz ? sz : 1);
+  if(ret == nullptr) throw std::bad_alloc();
+  return ret; 
+}
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete(void * p, size_t) noexcept { std::free(p); }
 
 template <typename T> void doFunc(std::vector<T> & v) {
   v[0] = T(0);
@@ -67,6 +84,326 @@ int test2() {
   return 0;
 }
 
+int test3() {
+  // eight threads pulling and dropping buffers through their magazines,
+  // and handing a few to their neighbors so that buffers get released
+  // on a thread other than the one that allocated them.
+  SoDa::BufferPool<int> pool("MagazinePool", 25, 16);
+  const int num_threads = 8;
+  std::atomic<int> errors(0);
+  std::vector<std::shared_ptr<SoDa::Buffer<int>>> handoff[num_threads];
+  std::mutex handoff_mtx[num_threads];
+  
+  std::vector<std::thread> threads;
+  for(int t = 0; t < num_threads; t++) {
+    threads.push_back(std::thread([&, t]() {
+	  for(int trial = 0; trial < 2000; trial++) {
+	    std::vector<std::shared_ptr<SoDa::Buffer<int>>> bufs;
+	    for(int i = 0; i < 20; i++) {
+	      auto bp = pool.getFromPool((i & 1) ? 100 : 300);
+	      bp->getVec()[0] = t;
+	      bp->getVec()[99] = trial;
+	      bufs.push_back(bp);
+	    }
+	    for(auto & bp : bufs) {
+	      if((bp->getVec()[0] != t) || (bp->getVec()[99] != trial)) errors++;
+	    }
+	    if(trial == 1000) {
+	      int next = (t + 1) % num_threads;
+	      std::lock_guard<std::mutex> lock(handoff_mtx[next]);
+	      handoff[next] = bufs;
+	    }
+	  }
+	  // release what our neighbor handed us -- it allocated them.
+	  bool released = false;
+	  while(!released) {
+	    {
+	      std::lock_guard<std::mutex> lock(handoff_mtx[t]);
+	      released = !handoff[t].empty();
+	      handoff[t].clear();
+	    }
+	    if(!released) std::this_thread::yield();
+	  }
+	}));
+  }
+  for(auto & th : threads) th.join();
+
+  if(errors != 0) {
+    std::cerr << "test3: " << errors << " buffers were shared between threads\n";
+    return 1;
+  }
+  std::cout << "test3 passed\n";
+  return 0;
+}
+
+// vector growth must move handles, not copy (and re-count) them
+static_assert(std::is_nothrow_move_constructible<SoDa::BufferHandle<int>>::value,
+	      "BufferHandle moves should be noexcept");
+
+int test4() {
+  // handles: one block per buffer, recycled whole
+  SoDa::BufferPool<int> pool("HandlePool", 4);
+  int * first_data; 
+  {
+    auto h = pool.getHandle(1000);
+    if((h.size() != 1000) || (h.useCount() != 1)) {
+      std::cerr << "test4: bad handle size " << h.size() << " or count " << h.useCount() << "\n";
+      return 1; 
+    }
+    first_data = h.data(); 
+    for(auto & v : h) v = 3;
+    auto h2 = h;
+    h2[7] = 5;
+    if((h.useCount() != 2) || (h[7] != 5) || (h != h2)) {
+      std::cerr << "test4: copied handle doesn't share the buffer\n";
+      return 1;
+    }
+  }
+  // the block we just released should be the first one handed back out.
+  {
+    auto h = pool.getHandle(1000);
+    if((h.data() != first_data) || (h[7] != 5)) {
+      std::cerr << "test4: block was not recycled\n";
+      return 1;
+    }
+  }
+
+  // once the pool is warm, get and release cycles shouldn't allocate.
+  long start_count = alloc_count;
+  for(int trial = 0; trial < 1000; trial++) {
+    SoDa::BufferHandle<int> hs[4]; 
+    for(int i = 0; i < 4; i++) {
+      hs[i] = pool.getHandle(1000);
+      hs[i][0] = trial;
+    }
+  }
+  if(alloc_count != start_count) {
+    std::cerr << "test4: " << (alloc_count - start_count) << " heap allocations in the steady state\n";
+    return 1; 
+  }
+
+  SoDa::BufferHandle<int> empty(0);
+  if(empty != nullptr) {
+    std::cerr << "test4: T(0) isn't an empty handle\n";
+    return 1;
+  }
+  
+  std::cout << "test4 passed\n";
+  return 0;
+}
+
+int test5() {
+  // size classes: every class must hold the sizes that map to it, and
+  // a class's capacity must map back to the class.
+  for(size_t n = 0; n < 100000; n++) {
+    size_t idx = SoDa::BufferPool<int>::sizeClassIndex(n);
+    size_t cap = SoDa::BufferPool<int>::sizeClassCapacity(idx);
+    if((cap < n) || ((n > 16) && (cap > n + n / 4)) || 
+       (SoDa::BufferPool<int>::sizeClassIndex(cap) != idx)) {
+      std::cerr << "test5: n = " << n << " landed in class " << idx << " capacity " << cap << "\n";
+      return 1;
+    }
+  }
+
+  SoDa::BufferPool<int> pool("ClassPool", 4, 0, true);
+  {
+    auto bp = pool.getFromPool(1000);
+    auto h = pool.getHandle(1000);
+    if((bp->size() != 1000) || (bp->getVec().size() < 1000) ||
+       (h.size() != 1000) || (h.capacity() < 1000)) {
+      std::cerr << "test5: size classes got the lengths wrong\n";
+      return 1;
+    }
+    // 1001 is in the same class as 1000, so it should share the free list.
+    int * hdata = h.data(); 
+    h.reset();
+    auto h2 = pool.getHandle(1001);
+    if(h2.data() != hdata) {
+      std::cerr << "test5: neighboring sizes didn't share a size class\n";
+      return 1;
+    }
+  }
+
+  // now a variable length workload, then trim it away
+  for(size_t n = 100; n < 5000; n += 37) {
+    auto h = pool.getHandle(n);
+    auto bp = pool.getFromPool(n);
+  }
+  if(pool.idleBytes() == 0) {
+    std::cerr << "test5: the pool should be holding idle storage\n";
+    return 1;
+  }
+  pool.trim(10000);
+  if(pool.idleBytes() > 10000) {
+    std::cerr << "test5: trim left " << pool.idleBytes() << " idle bytes\n";
+    return 1;
+  }
+  pool.trim();
+  if(pool.idleBytes() != 0) {
+    std::cerr << "test5: trim() left " << pool.idleBytes() << " idle bytes\n";
+    return 1;
+  }
+
+  // and with a ceiling, the pool shouldn't grow past it. 
+  pool.setMaxIdleBytes(64 * 1024);
+  for(size_t n = 100; n < 50000; n += 377) {
+    auto h = pool.getHandle(n);
+  }
+  if(pool.idleBytes() > 64 * 1024) {
+    std::cerr << "test5: the pool grew to " << pool.idleBytes() << " idle bytes\n";
+    return 1;
+  }
+  
+  std::cout << "test5 passed\n";
+  return 0;
+}
+
+int checkStoragePool(SoDa::BufferPool<float> & pool, size_t align, const std::string & what) {
+  std::vector<SoDa::BufferHandle<float>> hs; 
+  for(size_t n = 1; n < 20000; n = n * 3 + 1) {
+    auto h = pool.getHandle(n);
+    if((reinterpret_cast<uintptr_t>(h.data()) % align) != 0) {
+      std::cerr << "test6: " << what << " buffer of " << n << " isn't " << align << " byte aligned\n";
+      return 1;
+    }
+    for(auto & v : h) v = float(n);
+    hs.push_back(h);
+  }
+  for(auto & h : hs) {
+    for(auto & v : h) {
+      if(v != float(h.size())) {
+	std::cerr << "test6: " << what << " buffers overlap\n";
+	return 1;
+      }
+    }
+  }
+  hs.clear();
+  pool.trim();
+  return 0;
+}
+
+int test6() {
+  int errs = 0; 
+  std::cout << "test6: " << SoDa::BufferStorage::numNodes() << " NUMA node(s), this thread is on node " 
+	    << SoDa::BufferStorage::currentNode() << "\n";
+  {
+    SoDa::BufferPool<float> pool("AlignedPool", 4, std::make_shared<SoDa::AlignedStorage>(4096));
+    errs += checkStoragePool(pool, 4096, "AlignedStorage");
+  }
+  {
+    // huge pages, NUMA local, with magazines and size classes for good measure.
+    auto mstore = std::make_shared<SoDa::MMapStorage>(true, false, true);
+    SoDa::BufferPool<float> pool("MMapPool", 4, mstore, 8, true);
+    errs += checkStoragePool(pool, 64, "MMapStorage");
+    std::cout << "test6: MAP_HUGETLB " << (mstore->gotHugeTLB() ? "worked" : "fell back to THP") << "\n";
+  }
+  {
+    // a spread of lengths should share slabs, and trim() should give
+    // them back to the kernel.
+    auto mstore = std::make_shared<SoDa::MMapStorage>();
+    SoDa::BufferPool<float> pool("SpreadPool", 4, mstore);
+    size_t used = 0;
+    for(size_t n = 100; n < 5000; n += 37) {
+      auto h = pool.getHandle(n);
+      used += 4 * (n * sizeof(float) + 64);
+    }
+    size_t mapped = mstore->mappedBytes();
+    if(mapped > used + used / 2 + 2 * 1024 * 1024) {
+      std::cerr << "test6: MMapStorage mapped " << mapped << " bytes to hold " << used << "\n";
+      errs++;
+    }
+    pool.trim();
+    if(mstore->mappedBytes() != 0) {
+      std::cerr << "test6: MMapStorage still has " << mstore->mappedBytes() << " bytes mapped after trim()\n";
+      errs++;
+    }
+  }
+  try {
+    // locked pages may not be allowed here, so a failure isn't an error.
+    SoDa::BufferPool<float> pool("LockedPool", 4, std::make_shared<SoDa::MMapStorage>(false, true, false, 64 * 1024));
+    errs += checkStoragePool(pool, 64, "locked MMapStorage");
+  }
+  catch (SoDa::BufferStorageException & e) {
+    std::cout << "test6: skipping locked pages: " << e.what() << "\n";
+  }
+  if(errs == 0) std::cout << "test6 passed\n";
+  return errs;
+}
+
+int test7() {
+  // magazines with size classes: what a thread leaves in its magazines
+  // is still idle, and trim() has to get it back even after the
+  // thread is gone.
+  SoDa::BufferPool<int> pool("MagazinePool", 4, 8, true);
+  std::thread t([&]() {
+      for(size_t n = 100; n < 5000; n += 37) {
+	auto h = pool.getHandle(n);
+      }
+    });
+  t.join();
+  if((pool.magazineBytes() == 0) || (pool.idleBytes() < pool.magazineBytes())) {
+    std::cerr << "test7: magazines hold " << pool.magazineBytes() << " of "
+	      << pool.idleBytes() << " idle bytes\n";
+    return 1;
+  }
+  pool.trim();
+  if(pool.idleBytes() != 0) {
+    std::cerr << "test7: trim() left " << pool.idleBytes() << " idle bytes ("
+	      << pool.magazineBytes() << " in magazines)\n";
+    return 1;
+  }
+
+  // A live thread's magazines belong to it: trim() can only ask, and
+  // the thread empties them the next time it uses the pool.
+  std::atomic<int> phase(0);
+  std::thread live([&]() {
+      {
+	std::vector<SoDa::BufferHandle<int>> hs;
+	for(int i = 0; i < 16; i++) hs.push_back(pool.getHandle(1000));
+      }
+      phase = 1;
+      while(phase != 2) std::this_thread::yield();
+      pool.getHandle(1000);
+      phase = 3; 
+    });
+  while(phase != 1) std::this_thread::yield();
+  size_t before = pool.magazineBytes();
+  pool.trim();
+  phase = 2;
+  while(phase != 3) std::this_thread::yield();
+  live.join();
+  if(pool.magazineBytes() >= before) {
+    std::cerr << "test7: a live thread kept " << pool.magazineBytes() << " of its "
+	      << before << " magazine bytes after trim()\n";
+    return 1;
+  }
+
+  // the idle limit covers the magazines too
+  pool.setMaxIdleBytes(64 * 1024);
+  std::vector<std::thread> threads;
+  for(int i = 0; i < 4; i++) {
+    threads.push_back(std::thread([&]() {
+	  for(size_t n = 100; n < 50000; n += 377) {
+	    auto h = pool.getHandle(n);
+	  }
+	}));
+  }
+  for(auto & th : threads) th.join();
+  if(pool.idleBytes() > 64 * 1024) {
+    std::cerr << "test7: the pool grew to " << pool.idleBytes() << " idle bytes\n";
+    return 1;
+  }
+
+  std::cout << "test7 passed\n";
+  return 0;
+}
+
 int main() {
-  return test2();
+  int errs = test2();
+  errs += test3();
+  errs += test4();
+  errs += test5();
+  errs += test6();
+  errs += test7();
+  return errs;
 }
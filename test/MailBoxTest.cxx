@@ -1,14 +1,331 @@
 #include "../include/Buffer.hxx"
 #include "../include/BufferPool.hxx"
 #include "../include/MailBox.hxx"
+#include "../include/Selector.hxx"
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include <iostream>
 
+#include <poll.h>
+
 template <typename T> void doFunc(T & v) {
   v = T(0);
 }
 
+int lockFreeTest() {
+  // two producers, three subscribers, all banging on a lock-free mailbox
+  // The pool must outlive the mailbox, as the mailbox may still hold buffers.
+  SoDa::BufferPool<int> pool("LockFreePool", 16);
+  SoDa::MailBox<std::shared_ptr<SoDa::Buffer<int>>> mailbox("LockFreeMailBox", 1024, 4);
+  const int num_producers = 2;
+  const int num_subs = 3;
+  const int msgs_per_producer = 500;
+
+  std::vector<int> subs;
+  for(int i = 0; i < num_subs; i++) subs.push_back(mailbox.subscribe());
+  
+  // the fifth subscriber should be turned away
+  mailbox.subscribe();
+  try {
+    mailbox.subscribe();
+    std::cerr << "lockFreeTest: mailbox accepted too many subscribers\n";
+    return 1; 
+  }
+  catch(SoDa::MailBoxTooManySubscribersException & e) {
+    std::cerr << e.what() << "\n";
+  }
+  
+  std::atomic<int> sums[num_subs];
+  std::atomic<int> counts[num_subs];
+  for(int i = 0; i < num_subs; i++) {
+    sums[i] = 0;
+    counts[i] = 0; 
+  }
+
+  std::vector<std::thread> threads; 
+  for(int s = 0; s < num_subs; s++) {
+    threads.push_back(std::thread([&, s]() {
+	  while(counts[s] < num_producers * msgs_per_producer) {
+	    auto p = mailbox.get(subs[s]);
+	    if(p == nullptr) {
+	      std::this_thread::yield();
+	      continue; 
+	    }
+	    sums[s] += p->getVec()[0];
+	    counts[s]++;
+	  }
+	}));
+  }
+  for(int p = 0; p < num_producers; p++) {
+    threads.push_back(std::thread([&, p]() {
+	  for(int m = 0; m < msgs_per_producer; m++) {
+	    auto bp = pool.getFromPool(4);
+	    bp->getVec()[0] = p + 1;
+	    mailbox.put(bp);
+	  }
+	}));
+  }
+  for(auto & t : threads) t.join();
+
+  int expected = msgs_per_producer * (1 + 2);
+  for(int s = 0; s < num_subs; s++) {
+    if(sums[s] != expected) {
+      std::cerr << "lockFreeTest: subscriber " << s << " sum " << sums[s] << " expected " << expected << "\n";
+      return 1;
+    }
+  }
+  std::cout << "lockFreeTest passed\n";
+  return 0; 
+}
+
+int waitTest(SoDa::MailBox<std::shared_ptr<SoDa::Buffer<int>>> & mailbox, 
+	     SoDa::BufferPool<int> & pool) {
+  int sub = mailbox.subscribe();
+  
+  // nobody is sending anything, so this should time out
+  auto start = std::chrono::steady_clock::now();
+  auto p = mailbox.waitGet(sub, std::chrono::milliseconds(50));
+  auto waited = std::chrono::steady_clock::now() - start; 
+  if((p != nullptr) || (waited < std::chrono::milliseconds(40))) {
+    std::cerr << "waitTest: " << mailbox.getName() << " waitGet didn't time out properly\n";
+    return 1; 
+  }
+
+  // now send something while we're waiting
+  std::thread sender([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      auto bp = pool.getFromPool(4);
+      bp->getVec()[0] = 17;
+      mailbox.put(bp);
+    });
+  p = mailbox.waitGet(sub, std::chrono::seconds(5));
+  sender.join();
+  if((p == nullptr) || (p->getVec()[0] != 17)) {
+    std::cerr << "waitTest: " << mailbox.getName() << " waitGet missed the message\n";
+    return 1;
+  }
+
+  // batches
+  std::vector<std::shared_ptr<SoDa::Buffer<int>>> batch;
+  for(int i = 0; i < 10; i++) {
+    auto bp = pool.getFromPool(4);
+    bp->getVec()[0] = i;
+    batch.push_back(bp);
+  }
+  mailbox.putN(batch);
+
+  std::vector<std::shared_ptr<SoDa::Buffer<int>>> got;
+  if(mailbox.getN(sub, got, 3) != 3) {
+    std::cerr << "waitTest: " << mailbox.getName() << " getN came up short\n";
+    return 1;
+  }
+  if(mailbox.getAll(sub, got) != 7) {
+    std::cerr << "waitTest: " << mailbox.getName() << " getAll came up short\n";
+    return 1;
+  }
+  for(int i = 0; i < 10; i++) {
+    if(got[i]->getVec()[0] != i) {
+      std::cerr << "waitTest: " << mailbox.getName() << " batch out of order\n";
+      return 1;
+    }
+  }
+  if(mailbox.get(sub) != nullptr) {
+    std::cerr << "waitTest: " << mailbox.getName() << " getAll left something behind\n";
+    return 1;
+  }
+  
+  std::cout << "waitTest passed for " << mailbox.getName() << "\n";
+  return 0; 
+}
+
+int handleTest() {
+  // BufferHandles should travel through a mailbox just like shared pointers
+  SoDa::BufferPool<int> pool("HandlePool", 8);
+  SoDa::MailBox<SoDa::BufferHandle<int>> mailbox("HandleMailBox", 16);
+  int sub = mailbox.subscribe();
+  for(int i = 0; i < 4; i++) {
+    auto h = pool.getHandle(10);
+    h[0] = i;
+    mailbox.put(h);
+  }
+  for(int i = 0; i < 4; i++) {
+    auto h = mailbox.get(sub);
+    if((h == nullptr) || (h[0] != i) || (h.useCount() != 1)) {
+      std::cerr << "handleTest: bad handle from the mailbox\n";
+      return 1;
+    }
+  }
+  if(mailbox.get(sub) != nullptr) {
+    std::cerr << "handleTest: the mailbox should be empty\n";
+    return 1;
+  }
+  std::cout << "handleTest passed\n";
+  return 0; 
+}
+
+int policyTest(SoDa::MailBox<int> & mailbox) {
+  int newest = mailbox.subscribe(4, SoDa::MailBoxOverflow::DROP_NEWEST);
+  int oldest = mailbox.subscribe(4, SoDa::MailBoxOverflow::DROP_OLDEST);
+  int latest = mailbox.subscribe(4, SoDa::MailBoxOverflow::LATEST_ONLY);
+  for(int i = 1; i <= 10; i++) mailbox.put(i);
+
+  if((mailbox.lag(newest) != 4) || (mailbox.lag(oldest) != 4) || (mailbox.lag(latest) != 1)) {
+    std::cerr << "policyTest: " << mailbox.getName() << " queues are the wrong length\n";
+    return 1;
+  }
+  if((mailbox.dropped(newest) != 6) || (mailbox.dropped(oldest) != 6) || (mailbox.dropped(latest) != 9)) {
+    std::cerr << "policyTest: " << mailbox.getName() << " drop counts are wrong\n";
+    return 1;
+  }
+  std::vector<int> got;
+  mailbox.getAll(newest, got);
+  mailbox.getAll(oldest, got);
+  mailbox.getAll(latest, got);
+  std::vector<int> expected = { 1, 2, 3, 4, 7, 8, 9, 10, 10 };
+  if(got != expected) {
+    std::cerr << "policyTest: " << mailbox.getName() << " kept the wrong messages\n";
+    return 1;
+  }
+
+  // a slow BLOCK-ing subscriber should hold the producer back, not lose anything.
+  int slow = mailbox.subscribe(4, SoDa::MailBoxOverflow::BLOCK);
+  const int num_msgs = 200;
+  std::thread producer([&]() {
+      for(int i = 1; i <= num_msgs; i++) mailbox.put(i);
+    });
+  int errs = 0;
+  for(int i = 1; i <= num_msgs; ) {
+    if(mailbox.lag(slow) > 4) errs++;
+    int m = mailbox.waitGet(slow, std::chrono::seconds(5));
+    if(m != i) {
+      std::cerr << "policyTest: " << mailbox.getName() << " BLOCK subscriber got " << m << " expected " << i << "\n";
+      errs++;
+      break;
+    }
+    if((i % 50) == 0) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    i++;
+  }
+  producer.join();
+  if(mailbox.dropped(slow) != 0) errs++;
+  if(errs == 0) std::cout << "policyTest passed for " << mailbox.getName() << "\n";
+  return errs;
+}
+
+static bool fdReadable(int fd) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  return ::poll(&pfd, 1, 0) == 1;
+}
+
+int selectorTest() {
+  SoDa::MailBox<int> cmd("CommandMailBox");
+  SoDa::MailBox<int> samples("SampleMailBox", 64);
+  int cmd_sub = cmd.subscribe();
+  int sample_sub = samples.subscribe();
+
+  SoDa::Selector sel;
+  int cmd_idx = sel.add(cmd, cmd_sub);
+  int sample_idx = sel.add(samples, sample_sub);
+
+  // nothing to see here
+  if(sel.wait(std::chrono::milliseconds(20)) != -1) {
+    std::cerr << "selectorTest: wait() found mail in empty mailboxes\n";
+    return 1;
+  }
+  if(fdReadable(cmd.getEventFD(cmd_sub)) || fdReadable(samples.getEventFD(sample_sub))) {
+    std::cerr << "selectorTest: event descriptors weren't cleared\n";
+    return 1;
+  }
+
+  // a message sent while we sleep should wake us
+  std::thread sender([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      samples.put(5);
+    });
+  int r = sel.wait(std::chrono::seconds(5));
+  sender.join();
+  if((r != sample_idx) || (samples.get(sample_sub) != 5)) {
+    std::cerr << "selectorTest: wait() missed the sample message\n";
+    return 1;
+  }
+
+  // both busy: wait() should take them in turn
+  for(int i = 1; i <= 3; i++) {
+    cmd.put(i);
+    samples.put(i);
+  }
+  if(!fdReadable(cmd.getEventFD(cmd_sub))) {
+    std::cerr << "selectorTest: the command descriptor wasn't signaled\n";
+    return 1;
+  }
+  int last = -1;
+  for(int i = 0; i < 6; i++) {
+    r = sel.wait(std::chrono::seconds(1));
+    if((r < 0) || (r == last)) {
+      std::cerr << "selectorTest: wait() didn't alternate between mailboxes\n";
+      return 1;
+    }
+    if(r == cmd_idx) cmd.get(cmd_sub);
+    else samples.get(sample_sub);
+    last = r;
+  }
+  if(sel.poll() != -1) {
+    std::cerr << "selectorTest: poll() found mail after everything was read\n";
+    return 1;
+  }
+  std::cout << "selectorTest passed\n";
+  return 0;
+}
+
+// One consumer, and one producer per value of "tag": every producer's
+// values have to come out in the order they went in. 
+template<SoDa::RingMode mode>
+int ringTest(const std::string & what, int num_producers) {
+  SoDa::RingQueue<long, mode> ring(8);
+  const long per_producer = 20000;
+  long v;
+  if(ring.pop(v)) {
+    std::cerr << "ringTest: " << what << " popped from an empty ring\n";
+    return 1;
+  }
+  for(size_t i = 0; i < ring.capacity(); i++) ring.push(long(i));
+  if(ring.push(99) || (ring.size() != ring.capacity())) {
+    std::cerr << "ringTest: " << what << " pushed to a full ring\n";
+    return 1;
+  }
+  while(ring.pop(v)) { }
+
+  std::vector<std::thread> producers;
+  for(int p = 0; p < num_producers; p++) {
+    producers.push_back(std::thread([&ring, p, per_producer]() {
+	  for(long i = 0; i < per_producer; i++) {
+	    while(!ring.push(p * per_producer + i)) std::this_thread::yield();
+	  }
+	}));
+  }
+  std::vector<long> next(num_producers, 0);
+  int errs = 0;
+  for(long got = 0; got < per_producer * num_producers; ) {
+    if(!ring.pop(v)) {
+      std::this_thread::yield();
+      continue;
+    }
+    long p = v / per_producer;
+    if((v % per_producer) != next[p]) errs++;
+    next[p] = (v % per_producer) + 1;
+    got++;
+  }
+  for(auto & t : producers) t.join();
+  if(errs != 0) {
+    std::cerr << "ringTest: " << what << " delivered " << errs << " values out of order\n";
+    return 1;
+  }
+  std::cout << "ringTest passed for " << what << "\n";
+  return 0;
+}
+
 int main() {
   // create a mailbox
   SoDa::MailBox<std::shared_ptr<SoDa::Buffer<int>>> mailbox("TestMailBox"); 
@@ -47,4 +364,24 @@ int main() {
     }
     std::cout << "No more messages for subscriber " << s << "\n";
   }
+
+  int errs = lockFreeTest();
+
+  SoDa::BufferPool<int> wpool("WaitPool", 16);
+  SoDa::MailBox<std::shared_ptr<SoDa::Buffer<int>>> locked_mailbox("LockedWaitMailBox");
+  SoDa::MailBox<std::shared_ptr<SoDa::Buffer<int>>> lock_free_mailbox("LockFreeWaitMailBox", 64);
+  errs += waitTest(locked_mailbox, wpool);
+  errs += waitTest(lock_free_mailbox, wpool);
+  errs += handleTest();
+
+  SoDa::MailBox<int> locked_policy_mailbox("LockedPolicyMailBox");
+  SoDa::MailBox<int> lock_free_policy_mailbox("LockFreePolicyMailBox", 64);
+  errs += policyTest(locked_policy_mailbox);
+  errs += policyTest(lock_free_policy_mailbox);
+  errs += selectorTest();
+  errs += ringTest<SoDa::RingMode::SPSC>("SPSC", 1);
+  errs += ringTest<SoDa::RingMode::MPSC>("MPSC", 3);
+  errs += ringTest<SoDa::RingMode::MPMC>("MPMC", 3);
+  
+  return errs; 
 }
@@ -0,0 +1,245 @@
+#include "../include/SharedBufferPool.hxx"
+#include "../include/SharedMailBox.hxx"
+#include <thread>
+#include <atomic>
+#include <string>
+
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+// One process puts, another gets, through a named segment.
+int streamTest() {
+  std::string name = "/SoDaIPCTest_" + std::to_string(getpid());
+  const int num_msgs = 1000;
+  const size_t buf_len = 256;
+  // fewer buffers than queue slots, so the producer can never overrun the subscriber.
+  SoDa::SharedBufferPool<int> pool(name, buf_len, 32, 4, 4, 64);
+  SoDa::SharedMailBox<int> mailbox(pool);
+
+  int pfd[2];
+  if(pipe(pfd) != 0) return 1;
+
+  pid_t child = fork();
+  if(child == 0) {
+    int errs = 0;
+    {
+      SoDa::SharedBufferPool<int> cpool(name);
+      SoDa::SharedMailBox<int> cmailbox(cpool);
+      int id = cmailbox.subscribe();
+      char c = 'r';
+      if(write(pfd[1], &c, 1) != 1) errs++;
+      for(int i = 0; (i < num_msgs) && (errs == 0); ) {
+	auto h = cmailbox.get(id);
+	if(!h) {
+	  std::this_thread::yield();
+	  continue;
+	}
+	if(h.size() != buf_len) errs++;
+	for(size_t j = 0; j < h.size(); j++) {
+	  if(h[j] != int(i + j)) {
+	    errs++;
+	    break;
+	  }
+	}
+	i++;
+      }
+      if(cmailbox.dropped(id) != 0) errs++;
+    }
+    _exit(errs);
+  }
+
+  char c;
+  if(read(pfd[0], &c, 1) != 1) return 1;
+  for(int i = 0; i < num_msgs; ) {
+    auto h = pool.getHandle(buf_len);
+    if(!h) {
+      std::this_thread::yield();
+      continue;
+    }
+    for(size_t j = 0; j < h.size(); j++) h[j] = i + j;
+    mailbox.put(h);
+    i++;
+  }
+
+  int status;
+  waitpid(child, &status, 0);
+  close(pfd[0]);
+  close(pfd[1]);
+  int errs = 0;
+  if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+    std::cerr << "streamTest: subscriber process reported errors\n";
+    errs++;
+  }
+  if(pool.numFree() != pool.numBuffers()) {
+    std::cerr << "streamTest: " << pool.numBuffers() - pool.numFree() << " buffers never came back\n";
+    errs++;
+  }
+  if(errs == 0) std::cout << "streamTest passed\n";
+  return errs;
+}
+
+// A process dies holding a buffer and a subscription. reap() should get it all back.
+int reapTest() {
+  // an anonymous segment this time -- the child gets at it through the inherited fd.
+  SoDa::SharedBufferPool<float> pool("", 64, 8, 4, 4, 8);
+  SoDa::SharedMailBox<float> mailbox(pool);
+
+  int pfd[2];
+  if(pipe(pfd) != 0) return 1;
+
+  pid_t child = fork();
+  if(child == 0) {
+    // no destructors -- this process just vanishes.
+    SoDa::SharedBufferPool<float> * cpool = new SoDa::SharedBufferPool<float>(pool.getFD());
+    SoDa::SharedMailBox<float> cmailbox(*cpool);
+    cmailbox.subscribe();
+    auto h = cpool->getHandle(10);
+    auto h2 = h;
+    char c = 'r';
+    if(write(pfd[1], &c, 1) != 1) _exit(1);
+    _exit(h2 ? 0 : 1);
+  }
+
+  char c;
+  if(read(pfd[0], &c, 1) != 1) return 1;
+  {
+    // this one lands in the dead process's queue.
+    auto h = pool.getHandle(64);
+    mailbox.put(h);
+  }
+
+  int status;
+  waitpid(child, &status, 0);
+  close(pfd[0]);
+  close(pfd[1]);
+  int errs = 0;
+  if(pool.numFree() != pool.numBuffers() - 2) {
+    std::cerr << "reapTest: expected two buffers held before reap, got "
+	      << pool.numBuffers() - pool.numFree() << "\n";
+    errs++;
+  }
+  int reaped = mailbox.reap();
+  if(reaped != 1) {
+    std::cerr << "reapTest: reaped " << reaped << " participants, expected 1\n";
+    errs++;
+  }
+  if(pool.numFree() != pool.numBuffers()) {
+    std::cerr << "reapTest: " << pool.numBuffers() - pool.numFree() << " buffers still held after reap\n";
+    errs++;
+  }
+
+  // the dead subscriber's slot is open again, and so is the pool
+  int id = mailbox.subscribe();
+  auto h = pool.getHandle(5);
+  h[0] = 3.5;
+  mailbox.put(h);
+  auto g = mailbox.get(id);
+  if((g != h) || (g[0] != 3.5) || (g.size() != 5)) {
+    std::cerr << "reapTest: pool broken after reap\n";
+    errs++;
+  }
+  if(errs == 0) std::cout << "reapTest passed\n";
+  return errs;
+}
+
+// A child forked after the parent attached can read the buffers it
+// inherits, but must leave the parent's counts and slot alone.
+int forkTest() {
+  SoDa::SharedBufferPool<int> pool("", 16, 4, 4, 4, 8);
+  SoDa::SharedMailBox<int> mailbox(pool);
+  int id = mailbox.subscribe();
+  auto h = pool.getHandle(16);
+  h[0] = 42;
+
+  pid_t child = fork();
+  if(child == 0) {
+    int errs = 0;
+    {
+      // copying and dropping inherited handles must not touch the counts
+      auto h2 = h;
+      if(h2[0] != 42) errs++;
+      h.reset();
+      try {
+	pool.getHandle(4);
+	errs++;
+      }
+      catch (SoDa::SharedBufferPoolException & e) { }
+      try {
+	mailbox.get(id);
+	errs++;
+      }
+      catch (SoDa::SharedBufferPoolException & e) { }
+      // and a fresh attach works as usual
+      SoDa::SharedBufferPool<int> cpool(pool.getFD());
+      auto c = cpool.getHandle(8);
+      if(!c) errs++;
+    }
+    // run the inherited pool's destructor too -- it must not clean up
+    // after the parent.
+    pool.~SharedBufferPool();
+    _exit(errs);
+  }
+
+  int status;
+  waitpid(child, &status, 0);
+  int errs = 0;
+  if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+    std::cerr << "forkTest: child reported errors\n";
+    errs++;
+  }
+  if((pool.numFree() != pool.numBuffers() - 1) || (h[0] != 42)) {
+    std::cerr << "forkTest: the child disturbed the parent's buffer\n";
+    errs++;
+  }
+  if(mailbox.reap() != 0) {
+    std::cerr << "forkTest: reaped a live participant\n";
+    errs++;
+  }
+  mailbox.put(h);
+  auto g = mailbox.get(id);
+  if(g != h) {
+    std::cerr << "forkTest: the child disturbed the parent's subscription\n";
+    errs++;
+  }
+  if(errs == 0) std::cout << "forkTest passed\n";
+  return errs;
+}
+
+// Subscribers come and go while another thread puts.  Every buffer
+// has to find its way home, whichever way each race goes.
+int churnTest() {
+  SoDa::SharedBufferPool<float> pool("", 16, 32, 4, 4, 8);
+  SoDa::SharedMailBox<float> mailbox(pool);
+  std::atomic<bool> done(false);
+
+  std::thread putter([&]() {
+      while(!done.load()) {
+	auto h = pool.getHandle(16);
+	mailbox.put(h);
+      }
+    });
+  for(int i = 0; i < 20000; i++) {
+    int id = mailbox.subscribe();
+    if(i & 1) mailbox.get(id);
+    mailbox.unsubscribe(id);
+  }
+  done = true;
+  putter.join();
+
+  if(pool.numFree() != pool.numBuffers()) {
+    std::cerr << "churnTest: " << pool.numBuffers() - pool.numFree() << " buffers leaked\n";
+    return 1;
+  }
+  std::cout << "churnTest passed\n";
+  return 0;
+}
+
+int main() {
+  int errs = streamTest();
+  errs += reapTest();
+  errs += forkTest();
+  errs += churnTest();
+  return errs;
+}
@@ -0,0 +1,508 @@
+#include "../include/Buffer.hxx"
+#include "../include/BufferPool.hxx"
+#include "../include/MailBox.hxx"
+#include "IPCVersion.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <iostream>
+
+/**
+ * @file SoDaIPCBench.cxx
+ *
+ * Benchmarks for BufferPool and MailBox.
+ *
+ * Every scenario uses fixed sizes and thread counts, so two runs on
+ * the same machine are comparable.  Each one gets a warm-up pass
+ * first, and then its work is scaled up until a timed pass takes at
+ * least --min-seconds (0.5, or 0.1 with --quick) -- a run of a
+ * millisecond or two says more about the scheduler than the code.
+ *
+ * Each result is one line on stdout: a JSON object by default, or a
+ * CSV row with --csv.  The first line ("meta") records the version,
+ * git ID and build flags, so saved results can be matched to the
+ * code that made them.  Progress chatter goes to stderr.
+ *
+ * usage: SoDaIPCBench [--quick] [--csv] [--min-seconds S] [--only alloc|mailbox|fanout|ring]
+ *
+ *  - alloc: getFromPool()/getHandle() get-and-release throughput
+ *    against std::vector and malloc, across sizes and thread counts.
+ *  - mailbox: with 1..N producers and 1..M subscribers, locked and
+ *    lock-free, the saturated throughput ("mailbox_throughput"),
+ *    then put to get latency percentiles with the producers paced at
+ *    half that rate ("mailbox_latency"), so the latencies aren't
+ *    just time spent waiting in a full queue.
+ *  - fanout: the cost of one put() as the number of subscribers grows.
+ *  - ring: SoDa::RingQueue push/pop throughput in each RingMode, to
+ *    show what the single-producer and single-consumer modes save
+ *    over the MPMC ring that MailBox has to use.
+ */
+
+#ifndef SODA_IPC_BENCH_BUILD_TYPE
+#define SODA_IPC_BENCH_BUILD_TYPE "unknown"
+#endif
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct Options {
+    bool quick = false;
+    bool csv = false;
+    double min_seconds = 0.0; // 0 means "pick one from quick"
+    std::string only;
+  };
+
+  Options opts;
+
+  int64_t nowNS() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+  }
+
+  /**
+   * One line of output. Fields are printed in the order they're added.
+   */
+  class Result {
+  public:
+    Result(const std::string & bench) { add("bench", bench, true); }
+
+    Result & add(const std::string & key, const std::string & val, bool quote = true) {
+      fields.push_back(Field{key, val, quote});
+      return *this;
+    }
+    Result & add(const std::string & key, const char * val) { return add(key, std::string(val), true); }
+    template<typename N>
+    Result & add(const std::string & key, N val) {
+      std::ostringstream os;
+      os << val;
+      return add(key, os.str(), false);
+    }
+
+    void print() {
+      if(opts.csv) {
+	// a new header whenever the columns change
+	std::string hdr;
+	for(auto & f : fields) hdr += (hdr.empty() ? "" : ",") + f.key;
+	static std::string last_hdr;
+	if(hdr != last_hdr) {
+	  std::cout << hdr << "\n";
+	  last_hdr = hdr;
+	}
+	std::string row;
+	for(size_t i = 0; i < fields.size(); i++) row += (i ? "," : "") + fields[i].val;
+	std::cout << row << "\n";
+      }
+      else {
+	std::cout << "{";
+	for(size_t i = 0; i < fields.size(); i++) {
+	  auto & f = fields[i];
+	  std::cout << (i ? ", " : "") << "\"" << f.key << "\": ";
+	  if(f.quote) std::cout << "\"" << f.val << "\"";
+	  else std::cout << f.val;
+	}
+	std::cout << "}\n";
+      }
+      std::cout.flush();
+    }
+
+  private:
+    struct Field {
+      std::string key;
+      std::string val;
+      bool quote;
+    };
+    std::vector<Field> fields;
+  };
+
+  /**
+   * Run body(thread_index) on num_threads threads, all released at
+   * once.
+   * @returns the wall clock seconds from release to the last finish.
+   */
+  template<typename F>
+  double runThreads(int num_threads, F body) {
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < num_threads; t++) {
+      threads.push_back(std::thread([&, t]() {
+	    ready++;
+	    while(!go) std::this_thread::yield();
+	    body(t);
+	  }));
+    }
+    while(ready < num_threads) std::this_thread::yield();
+    auto start = Clock::now();
+    go = true;
+    for(auto & th : threads) th.join();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  /**
+   * Warm up, then repeat a measurement with more and more work until
+   * it takes at least opts.min_seconds.
+   *
+   * @param count the amount of work to start with.  On return, the
+   * amount in the pass that was kept.
+   * @param run does count units of work and returns the seconds it took.
+   * @returns the seconds for the kept pass.
+   */
+  template<typename F>
+  double calibrated(long & count, F run) {
+    const long MAX_COUNT = 1L << 32;
+    run(std::max(1L, count / 10));
+    while(1) {
+      double secs = run(count);
+      if((secs >= opts.min_seconds) || (count >= MAX_COUNT)) return secs;
+      double scale = (secs > 0.0) ? 1.2 * opts.min_seconds / secs : 10.0;
+      count = long(count * std::min(10.0, std::max(2.0, scale)));
+    }
+  }
+
+  // Each thread keeps a small window of live buffers, so the
+  // allocator can't just hand the same block back every time.
+  const int WINDOW = 8;
+
+  template<typename Get>
+  void allocLoop(long iterations, Get get) {
+    typedef decltype(get()) Buf;
+    std::vector<Buf> window(WINDOW);
+    for(long i = 0; i < iterations; i++) {
+      window[i % WINDOW] = get();
+    }
+  }
+
+  struct MallocBuf {
+    MallocBuf() : p(nullptr) { }
+    MallocBuf(size_t n) : p(static_cast<float*>(std::malloc(n * sizeof(float)))) { p[0] = 1.0f; }
+    MallocBuf(MallocBuf && o) : p(o.p) { o.p = nullptr; }
+    MallocBuf & operator=(MallocBuf && o) { std::swap(p, o.p); return *this; }
+    ~MallocBuf() { std::free(p); }
+    float * p;
+  };
+
+  void allocBench() {
+    std::vector<size_t> sizes = { 64, 1024, 16384, 262144 };
+    std::vector<int> thread_counts = { 1, 2, 4, 8 };
+    std::vector<std::string> impls = { "malloc", "vector", "shared_vector", "pool", "pool_magazine", "pool_handle" };
+
+    for(auto size : sizes) {
+      // keep the bytes touched per scenario roughly constant
+      long iterations = std::max(2000L, long(200000000 / (size * sizeof(float))));
+      if(opts.quick) iterations = std::max(200L, iterations / 20);
+      for(auto nthreads : thread_counts) {
+	for(auto & impl : impls) {
+	  std::cerr << "alloc " << impl << " size " << size << " threads " << nthreads << "\n";
+	  SoDa::BufferPool<float> pool("BenchPool", 16, (impl == "pool_magazine") ? 32 : 0);
+	  long count = iterations;
+	  double secs = calibrated(count, [&](long iterations) { return runThreads(nthreads, [&](int) {
+	      if(impl == "malloc") {
+		allocLoop(iterations, [&]() { return MallocBuf(size); });
+	      }
+	      else if(impl == "vector") {
+		allocLoop(iterations, [&]() { std::vector<float> v(size); v[0] = 1.0f; return v; });
+	      }
+	      else if(impl == "shared_vector") {
+		allocLoop(iterations, [&]() {
+		    auto v = std::make_shared<std::vector<float>>(size);
+		    (*v)[0] = 1.0f;
+		    return v;
+		  });
+	      }
+	      else if(impl == "pool_handle") {
+		allocLoop(iterations, [&]() { auto h = pool.getHandle(size); h[0] = 1.0f; return h; });
+	      }
+	      else {
+		allocLoop(iterations, [&]() { auto b = pool.getFromPool(size); b->getVec()[0] = 1.0f; return b; });
+	      }
+	    }); });
+	  double ops = double(count) * nthreads;
+	  Result("alloc").add("impl", impl).add("elements", size).add("threads", nthreads)
+	    .add("ops", long(ops)).add("seconds", secs)
+	    .add("ops_per_sec", ops / secs).add("ns_per_op", 1e9 * secs / ops).print();
+	}
+      }
+    }
+  }
+
+  typedef std::shared_ptr<SoDa::Buffer<int64_t>> Msg;
+
+  double percentile(const std::vector<int64_t> & sorted, double p) {
+    if(sorted.empty()) return 0.0;
+    return double(sorted[size_t(p * (sorted.size() - 1))]);
+  }
+
+  /**
+   * One pass of a mailbox scenario.  Producers stamp each message
+   * with the time it was put, and every subscriber gets every
+   * message.  With interval_ns > 0, each producer puts one message
+   * every interval_ns instead of as fast as it can.
+   *
+   * @param latencies if not null, where each subscriber notes how long
+   * each message took to arrive.
+   * @returns the wall clock seconds for the pass.
+   */
+  double mailboxPass(SoDa::MailBox<Msg> & mailbox, const std::vector<int> & subs,
+		     SoDa::BufferPool<int64_t> & pool, int num_producers, long msgs_per_producer,
+		     int64_t interval_ns, std::vector<std::vector<int64_t>> * latencies) {
+    int num_subs = subs.size();
+    long expected = msgs_per_producer * num_producers;
+    if(latencies) {
+      latencies->assign(num_subs, std::vector<int64_t>());
+      for(auto & l : *latencies) l.reserve(expected);
+    }
+
+    return runThreads(num_producers + num_subs, [&](int t) {
+	if(t < num_subs) {
+	  long got = 0;
+	  while(got < expected) {
+	    auto m = mailbox.get(subs[t]);
+	    if(m == nullptr) {
+	      std::this_thread::yield();
+	      continue;
+	    }
+	    if(latencies) (*latencies)[t].push_back(nowNS() - m->getVec()[0]);
+	    got++;
+	  }
+	}
+	else {
+	  int64_t next = nowNS();
+	  for(long i = 0; i < msgs_per_producer; i++) {
+	    if(interval_ns > 0) {
+	      while(nowNS() < next) std::this_thread::yield();
+	      // if we fell behind, don't catch up in a burst
+	      next = std::max(next + interval_ns, nowNS());
+	    }
+	    auto b = pool.getFromPool(16);
+	    b->getVec()[0] = nowNS();
+	    mailbox.put(b);
+	  }
+	}
+      });
+  }
+
+  /**
+   * First the saturated throughput: producers put as fast as they
+   * can into BLOCK-ing queues of 1024 messages.  Latency measured
+   * that way is mostly time spent in a full queue, so the latency
+   * pass paces the producers at LATENCY_LOAD times the saturated
+   * rate.
+   */
+  void mailboxRun(bool lock_free, int num_producers, int num_subs, long msgs_per_producer) {
+    std::cerr << "mailbox " << (lock_free ? "lock_free" : "locked")
+	      << " producers " << num_producers << " subscribers " << num_subs << "\n";
+    const size_t QUEUE = 1024;
+    const double LATENCY_LOAD = 0.5;
+    // the pool must outlive the mailbox
+    SoDa::BufferPool<int64_t> pool("BenchMsgPool", 64, 32);
+    std::unique_ptr<SoDa::MailBox<Msg>> mbp(lock_free ?
+					    new SoDa::MailBox<Msg>("BenchMailBox", QUEUE) :
+					    new SoDa::MailBox<Msg>("BenchMailBox"));
+    SoDa::MailBox<Msg> & mailbox = *mbp;
+    std::vector<int> subs;
+    for(int s = 0; s < num_subs; s++) subs.push_back(mailbox.subscribe(QUEUE, SoDa::MailBoxOverflow::BLOCK));
+    const char * mode = lock_free ? "lock_free" : "locked";
+
+    long count = msgs_per_producer;
+    double secs = calibrated(count, [&](long n) {
+	return mailboxPass(mailbox, subs, pool, num_producers, n, 0, nullptr);
+      });
+    double puts = double(count) * num_producers;
+    double put_rate = puts / secs;
+    Result("mailbox_throughput").add("mode", mode)
+      .add("producers", num_producers).add("subscribers", num_subs)
+      .add("messages", long(puts)).add("seconds", secs)
+      .add("puts_per_sec", put_rate).add("deliveries_per_sec", puts * num_subs / secs).print();
+
+    // enough paced messages to fill the minimum duration
+    int64_t interval_ns = int64_t(1e9 * num_producers / (LATENCY_LOAD * put_rate));
+    long paced = std::max(100L, long(opts.min_seconds * 1e9 / std::max(int64_t(1), interval_ns)));
+    paced = std::min(paced, 1000000L / num_producers);
+    mailboxPass(mailbox, subs, pool, num_producers, std::max(10L, paced / 10), interval_ns, nullptr);
+    std::vector<std::vector<int64_t>> latencies;
+    secs = mailboxPass(mailbox, subs, pool, num_producers, paced, interval_ns, &latencies);
+
+    std::vector<int64_t> all;
+    for(auto & l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    Result("mailbox_latency").add("mode", mode)
+      .add("producers", num_producers).add("subscribers", num_subs)
+      .add("load", LATENCY_LOAD).add("target_puts_per_sec", LATENCY_LOAD * put_rate)
+      .add("puts_per_sec", double(paced) * num_producers / secs)
+      .add("messages", paced * num_producers).add("seconds", secs)
+      .add("p50_ns", percentile(all, 0.50)).add("p90_ns", percentile(all, 0.90))
+      .add("p99_ns", percentile(all, 0.99)).add("p999_ns", percentile(all, 0.999))
+      .add("max_ns", all.empty() ? 0.0 : double(all.back())).print();
+  }
+
+  void printMeta() {
+#ifdef __OPTIMIZE__
+    bool optimized = true;
+#else
+    bool optimized = false;
+#endif
+#if defined(__GNUC__) && !defined(__clang__)
+    std::string compiler = std::string("gcc ") + __VERSION__;
+#else
+    std::string compiler = __VERSION__;
+#endif
+#ifdef SODA_IPC_HAVE_NUMA
+    bool numa = true;
+#else
+    bool numa = false;
+#endif
+    Result("meta").add("version", SoDaIPC_VERSION).add("git_id", SoDaIPC_GIT_ID)
+      .add("build_type", SODA_IPC_BENCH_BUILD_TYPE).add("compiler", compiler)
+      .add("optimized", optimized ? "true" : "false", false)
+      .add("stats", SoDa::statsEnabled() ? "true" : "false", false)
+      .add("numa", numa ? "true" : "false", false)
+      .add("hardware_threads", std::thread::hardware_concurrency())
+      .add("quick", opts.quick ? "true" : "false", false)
+      .add("min_seconds", opts.min_seconds).print();
+  }
+
+  void mailboxBench() {
+    std::vector<int> producer_counts = { 1, 2, 4 };
+    std::vector<int> subscriber_counts = { 1, 2, 4 };
+    long msgs = opts.quick ? 2000 : 50000;
+    for(int lf = 0; lf < 2; lf++) {
+      for(auto p : producer_counts) {
+	for(auto s : subscriber_counts) {
+	  mailboxRun(lf == 1, p, s, msgs / p);
+	}
+      }
+    }
+  }
+
+  /**
+   * One producer, no consumers running: how long does a put() take
+   * as the subscriber count grows?
+   */
+  void fanoutBench() {
+    std::vector<int> subscriber_counts = { 1, 2, 4, 8, 16, 32 };
+    const long msgs = opts.quick ? 1000 : 10000;
+    const int reps = opts.quick ? 3 : 10;
+    for(int lf = 0; lf < 2; lf++) {
+      for(auto num_subs : subscriber_counts) {
+	std::cerr << "fanout " << (lf ? "lock_free" : "locked") << " subscribers " << num_subs << "\n";
+	SoDa::BufferPool<int64_t> pool("BenchFanoutPool", 64);
+	std::unique_ptr<SoDa::MailBox<Msg>> mbp(lf ?
+						new SoDa::MailBox<Msg>("FanoutMailBox", msgs, num_subs) :
+						new SoDa::MailBox<Msg>("FanoutMailBox"));
+	SoDa::MailBox<Msg> & mailbox = *mbp;
+	std::vector<int> subs;
+	for(int s = 0; s < num_subs; s++) subs.push_back(mailbox.subscribe());
+
+	std::vector<Msg> msgv;
+	for(long i = 0; i < msgs; i++) msgv.push_back(pool.getFromPool(16));
+
+	// Best of several reps, to shake out scheduler noise, after one
+	// warm-up rep that isn't counted.  Keep going past reps until
+	// the timed reps add up to the minimum duration.
+	double best = 1e99;
+	double total = 0.0;
+	std::vector<Msg> drain;
+	for(int r = -1; (r < reps) || (total < opts.min_seconds); r++) {
+	  auto start = Clock::now();
+	  for(auto & m : msgv) mailbox.put(m);
+	  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+	  if(r >= 0) {
+	    best = std::min(best, secs);
+	    total += secs;
+	  }
+	  for(auto s : subs) {
+	    drain.clear();
+	    mailbox.getAll(s, drain);
+	  }
+	}
+	Result("fanout").add("mode", lf ? "lock_free" : "locked").add("subscribers", num_subs)
+	  .add("puts", msgs).add("seconds", best).add("total_seconds", total)
+	  .add("ns_per_put", 1e9 * best / msgs)
+	  .add("ns_per_delivery", 1e9 * best / (msgs * num_subs)).print();
+      }
+    }
+  }
+}
+
+namespace {
+  /**
+   * Producers push count values each into a 1024 slot ring, and the
+   * consumers pop until each has seen a stop value.  The last producer
+   * to finish pushes one stop value per consumer, so nobody shares a
+   * counter in the inner loop.
+   */
+  template<SoDa::RingMode mode>
+  void ringRun(const char * mode_name, int num_producers, int num_consumers) {
+    std::cerr << "ring " << mode_name << " producers " << num_producers
+	      << " consumers " << num_consumers << "\n";
+    SoDa::RingQueue<long, mode> ring(1024);
+    long count = opts.quick ? 10000 : 100000;
+    double secs = calibrated(count, [&](long n) {
+	std::atomic<int> producers_done(0);
+	return runThreads(num_producers + num_consumers, [&](int t) {
+	    if(t < num_consumers) {
+	      long v;
+	      while(1) {
+		if(!ring.pop(v)) std::this_thread::yield();
+		else if(v < 0) break;
+	      }
+	    }
+	    else {
+	      for(long i = 0; i < n; i++) {
+		while(!ring.push(i)) std::this_thread::yield();
+	      }
+	      if(++producers_done == num_producers) {
+		for(int c = 0; c < num_consumers; c++) {
+		  while(!ring.push(-1)) std::this_thread::yield();
+		}
+	      }
+	    }
+	  });
+      });
+    double ops = double(count) * num_producers;
+    Result("ring").add("mode", mode_name).add("producers", num_producers)
+      .add("consumers", num_consumers).add("items", long(ops)).add("seconds", secs)
+      .add("items_per_sec", ops / secs).add("ns_per_item", 1e9 * secs / ops).print();
+  }
+
+  void ringBench() {
+    ringRun<SoDa::RingMode::SPSC>("SPSC", 1, 1);
+    ringRun<SoDa::RingMode::MPSC>("MPSC", 1, 1);
+    ringRun<SoDa::RingMode::MPMC>("MPMC", 1, 1);
+    ringRun<SoDa::RingMode::MPSC>("MPSC", 4, 1);
+    ringRun<SoDa::RingMode::MPMC>("MPMC", 4, 1);
+    ringRun<SoDa::RingMode::MPMC>("MPMC", 4, 4);
+  }
+}
+
+int main(int argc, char * argv[]) {
+  for(int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if(a == "--quick") opts.quick = true;
+    else if(a == "--csv") opts.csv = true;
+    else if((a == "--min-seconds") && (i + 1 < argc)) opts.min_seconds = std::atof(argv[++i]);
+    else if((a == "--only") && (i + 1 < argc)) opts.only = argv[++i];
+    else {
+      std::cerr << "usage: " << argv[0] << " [--quick] [--csv] [--min-seconds S] [--only alloc|mailbox|fanout|ring]\n";
+      return 1;
+    }
+  }
+  if(opts.min_seconds <= 0.0) opts.min_seconds = opts.quick ? 0.1 : 0.5;
+
+  printMeta();
+
+  if(opts.only.empty() || (opts.only == "alloc")) allocBench();
+  if(opts.only.empty() || (opts.only == "mailbox")) mailboxBench();
+  if(opts.only.empty() || (opts.only == "fanout")) fanoutBench();
+  if(opts.only.empty() || (opts.only == "ring")) ringBench();
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "../include/BufferPool.hxx"
+#include "../include/MailBox.hxx"
+#include <memory>
+#include <thread>
+#include <vector>
+#include <numeric>
+
+#include <iostream>
+
+// This test is built with SODA_IPC_STATS defined, whatever ENABLE_STATS says.
+
+static uint64_t total(const std::vector<uint64_t> & v) {
+  return std::accumulate(v.begin(), v.end(), uint64_t(0));
+}
+
+int poolStatsTest(size_t magazine_size) {
+  int errs = 0;
+  SoDa::BufferPool<int> pool("StatsPool", 4, magazine_size);
+
+  std::vector<SoDa::BufferHandle<int>> held;
+  for(int i = 0; i < 10; i++) held.push_back(pool.getHandle(100));
+  auto s = pool.snapshot();
+  if(!s.enabled || (s.gets != 10) || (s.outstanding != 10) || (s.allocated < 10) || (s.refills == 0)) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): bad counts after the first gets\n";
+    errs++;
+  }
+  held.clear();
+  uint64_t allocated = s.allocated;
+
+  // the second round should come entirely from the pool
+  for(int i = 0; i < 10; i++) held.push_back(pool.getHandle(100));
+  if(pool.snapshot().allocated != allocated) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): the second round of handles shouldn't allocate\n";
+    errs++;
+  }
+  auto v = pool.getFromPool(50);
+  held.clear();
+  v = nullptr;
+  s = pool.snapshot();
+  if((s.gets != 21) || (s.returns != 21) || (s.outstanding != 0)) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): gets " << s.gets << " returns " << s.returns << "\n";
+    errs++;
+  }
+
+  size_t by_size = 0;
+  for(auto & e : s.idle_bytes_by_size) by_size += e.second;
+  if(by_size + s.magazine_bytes != s.idle_bytes) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): idle bytes by size " << by_size
+	      << " plus " << s.magazine_bytes << " in magazines don't add up to " << s.idle_bytes << "\n";
+    errs++;
+  }
+
+  // a few threads fighting over the allocation lock
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&]() {
+	  for(int i = 0; i < 1000; i++) {
+	    auto h = pool.getHandle(64);
+	    h[0] = i;
+	  }
+	}));
+  }
+  for(auto & t : threads) t.join();
+  s = pool.snapshot();
+  if((s.lock_wait.size() != SoDa::LockWaitHistogram::NUM_BUCKETS) || (total(s.lock_wait) == 0)) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): no lock waits recorded\n";
+    errs++;
+  }
+  if((s.gets != 4021) || (s.outstanding != 0)) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): gets " << s.gets << " after the threads\n";
+    errs++;
+  }
+  pool.trim();
+  s = pool.snapshot();
+  if((s.freed == 0) || !s.idle_bytes_by_size.empty() || (s.idle_bytes != 0)) {
+    std::cerr << "poolStatsTest(" << magazine_size << "): trim didn't show up\n";
+    errs++;
+  }
+  if(errs == 0) std::cout << "poolStatsTest(" << magazine_size << ") passed\n";
+  return errs;
+}
+
+int mailBoxStatsTest(SoDa::MailBox<int> & mailbox) {
+  int errs = 0;
+  int a = mailbox.subscribe();
+  int b = mailbox.subscribe();
+  for(int i = 1; i <= 5; i++) mailbox.put(i);
+  mailbox.get(a);
+  std::vector<int> got;
+  mailbox.getN(a, got, 2);
+
+  auto s = mailbox.snapshot();
+  if(!s.enabled || (s.puts != 5) || (s.subscribers.size() != 2)) {
+    std::cerr << "mailBoxStatsTest: " << mailbox.getName() << " bad put count\n";
+    return 1;
+  }
+  auto & sa = s.subscribers[a];
+  auto & sb = s.subscribers[b];
+  if((sa.depth != 2) || (sa.received != 3) || (sa.high_water != 5) ||
+     (sb.depth != 5) || (sb.received != 0) || (sb.high_water != 5) || (sb.dropped != 0)) {
+    std::cerr << "mailBoxStatsTest: " << mailbox.getName() << " bad subscriber counts\n";
+    errs++;
+  }
+  if(!mailbox.isLockFree() && (total(s.lock_wait) == 0)) {
+    std::cerr << "mailBoxStatsTest: " << mailbox.getName() << " no lock waits recorded\n";
+    errs++;
+  }
+  if(!mailbox.isLockFree() && (total(s.ring_wait) != 0)) {
+    std::cerr << "mailBoxStatsTest: " << mailbox.getName() << " ring waits recorded in locked mode\n";
+    errs++;
+  }
+  if(errs == 0) std::cout << "mailBoxStatsTest passed for " << mailbox.getName() << "\n";
+  return errs;
+}
+
+int main() {
+  int errs = poolStatsTest(0);
+  errs += poolStatsTest(8);
+
+  SoDa::MailBox<int> locked_mailbox("LockedStatsMailBox");
+  SoDa::MailBox<int> lock_free_mailbox("LockFreeStatsMailBox", 16);
+  errs += mailBoxStatsTest(locked_mailbox);
+  errs += mailBoxStatsTest(lock_free_mailbox);
+  return errs;
+}